@@ -10,19 +10,302 @@ This Message Queue Server supports the following REST API:
 
     PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+
+    PUT     /ack/$queue                 Acknowledge leased messages (ids in body).
+    PUT     /nack/$queue                Return leased messages to $queue (ids in body).
+
+Retrieving with GET /queue/$queue?lease=$milliseconds leases the message
+instead of removing it: the response carries its id in the X-SMQ-Message
+header and the message returns to the front of the queue unless it is
+acknowledged before the lease expires.
+
+Retrieving with GET /queue/$queue?wait=$milliseconds gives up after that long
+instead of waiting until a message arrives, so that a client can take turns
+polling several queues.
+
+Publishing with an X-SMQ-TTL header (milliseconds) gives the message a time
+to live: once it passes, the message is dropped instead of delivered, and a
+retrieved message carries the time it has left in the same header.
+
+Topics are hierarchical words separated by '.' (ie. metrics.host1.cpu), and
+subscriptions may use wildcards: '*' matches exactly one word and '#' matches
+zero or more words (ie. metrics.*.cpu or metrics.#).
+
+When started with --data=$directory, queues are stored in segmented
+append-only logs under $directory (read back through mmap) along with each
+queue's read offset and the subscriptions, so a restarted server resumes from
+its last checkpoint.  The checkpoint never moves past a message that is still
+leased (or was returned by a lease), so a restart redelivers unacknowledged
+messages rather than losing them.  Lease ids carry the epoch of the server
+that issued them, so a stale id from before a restart acknowledges nothing.
 '''
 
+import atexit
+import bisect
 import collections
+import heapq
+import json
 import logging
+import mmap
+import os
 import signal
 import socket
+import struct
 import sys
 import time
+import urllib.parse
 
 import tornado.gen
 import tornado.options
 import tornado.web
 
+# Tracing
+
+MESSAGE_HEADER = 'X-SMQ-Message'
+TRACE_HEADER   = 'X-SMQ-Trace'
+TTL_HEADER     = 'X-SMQ-TTL'
+TRACE_BROKER = 3    # Index of broker receive stamp (see include/smq/trace.h)
+
+def stamp_trace(trace, stage):
+    ''' Record CLOCK_MONOTONIC nanoseconds as stage in comma-separated trace. '''
+    stamps = trace.split(',')
+    stamps.extend(['0'] * (stage + 1 - len(stamps)))
+    stamps[stage] = str(time.monotonic_ns())
+    return ','.join(stamps)
+
+# Persistent Queues
+
+class Record(tuple):
+    ''' (message, trace, expires) read back from a segment, along with its offset. '''
+    offset = None
+
+class SegmentQueue(object):
+    ''' Queue of (message, trace, expires) records stored in append-only segment files.
+
+    Records are appended to the newest segment and read back through mmap, so
+    a backlog lives in the page cache instead of the broker's heap.  Segments
+    are deleted once the checkpoint moves past them, and the read offset is
+    checkpointed so a restart resumes where consumers left off.  Messages
+    returned by expired or rejected leases are kept in memory at the front.
+
+    Records handed out are unsettled until settle is called (once they are
+    acknowledged, or retrieved without a lease), and the checkpoint stops at
+    the oldest unsettled one.
+    '''
+    HEADER       = struct.Struct('<IId')   # message length, trace length, expires (epoch seconds, 0 for never)
+    SEGMENT_SIZE = 1 << 26
+    OFFSET_FILE  = 'offset'
+
+    def __init__(self, path):
+        os.makedirs(path, exist_ok=True)
+        self.path     = path
+        self.returned  = collections.deque()
+        self.unsettled = set()     # Offsets of records handed out but not yet settled
+        self.maps      = {}
+        self.segments = sorted(int(name[:-4]) for name in os.listdir(path) if name.endswith('.log'))
+        if not self.segments:
+            self.segments = [0]
+            open(self.segment_path(0), 'ab').close()
+
+        last              = self.segments[-1]
+        self.write_offset = last + os.path.getsize(self.segment_path(last))
+        self.read_offset  = max(self.segments[0], self.load_offset())
+        self.checkpointed = self.read_offset
+        self.writer       = open(self.segment_path(last), 'ab')
+        self.count        = self.count_records()
+        self.remove_consumed()
+
+    def segment_path(self, base):
+        return os.path.join(self.path, '{:020d}.log'.format(base))
+
+    def load_offset(self):
+        try:
+            with open(os.path.join(self.path, self.OFFSET_FILE)) as stream:
+                return int(stream.read().strip() or 0)
+        except (IOError, ValueError):
+            return 0
+
+    def count_records(self):
+        ''' Count unread records by walking record headers from read offset. '''
+        count  = 0
+        offset = self.read_offset
+        while offset < self.write_offset:
+            offset += self.record_size(offset)
+            count  += 1
+        return count
+
+    def segment_for(self, offset):
+        ''' Return base of segment containing offset. '''
+        return self.segments[bisect.bisect_right(self.segments, offset) - 1]
+
+    def remove_consumed(self):
+        ''' Delete segments that lie entirely before the checkpoint. '''
+        while len(self.segments) > 1 and self.checkpointed >= self.segments[1]:
+            base   = self.segments.pop(0)
+            mapped = self.maps.pop(base, None)
+            if mapped:
+                mapped.close()
+            os.unlink(self.segment_path(base))
+
+    def view(self, base, end):
+        ''' Return mmap of segment covering at least end bytes of it. '''
+        mapped = self.maps.get(base)
+        if mapped is None or len(mapped) < end:
+            if mapped:
+                mapped.close()
+            with open(self.segment_path(base), 'rb') as stream:
+                mapped = mmap.mmap(stream.fileno(), 0, access=mmap.ACCESS_READ)
+            self.maps[base] = mapped
+        return mapped
+
+    def record_size(self, offset):
+        base   = self.segment_for(offset)
+        start  = offset - base
+        mapped = self.view(base, start + self.HEADER.size)
+        message_length, trace_length, _ = self.HEADER.unpack_from(mapped, start)
+        return self.HEADER.size + message_length + trace_length
+
+    def append(self, item):
+        message, trace, expires = item
+        trace  = trace.encode() if trace else b''
+        record = self.HEADER.pack(len(message), len(trace), expires or 0) + message + trace
+
+        current = self.write_offset - self.segments[-1]
+        if current and current + len(record) > self.SEGMENT_SIZE:
+            self.writer.close()
+            self.segments.append(self.write_offset)
+            self.writer = open(self.segment_path(self.write_offset), 'ab')
+
+        self.writer.write(record)
+        self.writer.flush()
+        self.write_offset += len(record)
+        self.count        += 1
+
+    def appendleft(self, item):
+        self.returned.appendleft(item)
+
+    def popleft(self):
+        if self.returned:
+            return self.returned.popleft()
+        if not self.count:
+            raise IndexError('pop from an empty queue')
+
+        base   = self.segment_for(self.read_offset)
+        start  = self.read_offset - base
+        size   = self.record_size(self.read_offset)
+        mapped = self.view(base, start + size)
+        message_length, trace_length, expires = self.HEADER.unpack_from(mapped, start)
+
+        start  += self.HEADER.size
+        message = mapped[start:start + message_length]
+        trace   = mapped[start + message_length:start + message_length + trace_length]
+
+        item        = Record((message, trace.decode() or None, expires or None))
+        item.offset = self.read_offset
+        self.unsettled.add(item.offset)
+
+        self.read_offset += size
+        self.count       -= 1
+        return item
+
+    def settle(self, item):
+        ''' Let checkpoint move past record, since it no longer needs redelivery. '''
+        self.unsettled.discard(getattr(item, 'offset', None))
+
+    def checkpoint(self):
+        ''' Atomically record offset of oldest unsettled record (if it changed since last time). '''
+        offset = min(self.unsettled, default=self.read_offset)
+        if offset == self.checkpointed:
+            return
+        temporary = os.path.join(self.path, self.OFFSET_FILE + '.tmp')
+        with open(temporary, 'w') as stream:
+            stream.write(str(offset))
+        os.replace(temporary, os.path.join(self.path, self.OFFSET_FILE))
+        self.checkpointed = offset
+        self.remove_consumed()
+
+    def __len__(self):
+        return len(self.returned) + self.count
+
+class SegmentQueues(dict):
+    ''' Mapping of queue name to SegmentQueue stored under a data directory. '''
+    def __init__(self, path):
+        dict.__init__(self)
+        self.path = path
+        os.makedirs(path, exist_ok=True)
+        for name in os.listdir(path):
+            if os.path.isdir(os.path.join(path, name)):
+                self[urllib.parse.unquote(name)]
+
+    def __missing__(self, queue):
+        self[queue] = SegmentQueue(os.path.join(self.path, urllib.parse.quote(queue, safe='')))
+        return self[queue]
+
+    def checkpoint(self):
+        for queue in self.values():
+            queue.checkpoint()
+
+# Topic Trie
+
+class TopicTrie(object):
+    ''' Trie of subscription patterns keyed by topic word.
+
+    Matching a topic walks one level per word, so resolving the subscribers
+    of a publish costs O(topic depth) rather than O(subscriptions).
+    '''
+    SEPARATOR = '.'
+    SINGLE    = '*'
+    MULTIPLE  = '#'
+
+    def __init__(self):
+        self.children = {}
+        self.queues   = set()
+
+    def add(self, pattern, queue):
+        ''' Add queue as subscriber of pattern. '''
+        node = self
+        for word in pattern.split(self.SEPARATOR):
+            node = node.children.setdefault(word, TopicTrie())
+        node.queues.add(queue)
+
+    def remove(self, pattern, queue):
+        ''' Remove queue as subscriber of pattern (pruning empty nodes). '''
+        path = [self]
+        for word in pattern.split(self.SEPARATOR):
+            if word not in path[-1].children:
+                return False
+            path.append(path[-1].children[word])
+
+        if queue not in path[-1].queues:
+            return False
+        path[-1].queues.remove(queue)
+
+        for parent, word, node in reversed(list(zip(path, pattern.split(self.SEPARATOR), path[1:]))):
+            if node.queues or node.children:
+                break
+            del parent.children[word]
+        return True
+
+    def match(self, topic):
+        ''' Return set of queues subscribed to patterns matching topic. '''
+        queues = set()
+        self._match(topic.split(self.SEPARATOR), 0, queues)
+        return queues
+
+    def _match(self, words, index, queues):
+        wildcard = self.children.get(self.MULTIPLE)
+        if wildcard:
+            for next_index in range(index, len(words) + 1):
+                wildcard._match(words, next_index, queues)
+
+        if index == len(words):
+            queues.update(self.queues)
+            return
+
+        for word in (words[index], self.SINGLE):
+            if word in self.children:
+                self.children[word]._match(words, index + 1, queues)
+
 # Base Handler
 
 class BaseHandler(tornado.web.RequestHandler):
@@ -43,12 +326,17 @@ class TopicHandler(BaseHandler):
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
         message     = self.request.body
+        trace       = self.request.headers.get(TRACE_HEADER)
+        ttl         = self.request.headers.get(TTL_HEADER)
+        expires     = time.time() + int(ttl) / 1000.0 if ttl else None
         subscribers = 0
 
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
-                subscribers += 1
+        if trace:
+            trace = stamp_trace(trace, TRACE_BROKER)
+
+        for queue in self.application.topics.match(topic):
+            self.application.queues[queue].append((message, trace, expires))
+            subscribers += 1
 
         if subscribers:
             self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
@@ -69,14 +357,65 @@ class QueueHandler(BaseHandler):
         if queue not in self.application.queues:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(0.1)
-
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].popleft())
+        lease = self.get_query_argument('lease', None)
+        wait  = self.get_query_argument('wait', None)
+        until = time.time() + int(wait) / 1000.0 if wait is not None else None
+
+        self.application.expire_leases()
+        item = self.application.pop(queue)
+        while item is None and not self.request.connection.stream.closed():
+            if until is not None and time.time() >= until:
+                break
+            yield tornado.gen.sleep(0.1 if until is None else max(0, min(0.1, until - time.time())))
+            self.application.expire_leases()
+            item = self.application.pop(queue)
+
+        if item is not None:
+            message, trace, expires = item
+            if lease:
+                identifier = self.application.lease(queue, item, int(lease))
+                self.set_header(MESSAGE_HEADER, identifier)
+            else:
+                self.application.settle(queue, item)
+            if trace:
+                self.set_header(TRACE_HEADER, trace)
+            if expires:
+                self.set_header(TTL_HEADER, max(1, int((expires - time.time()) * 1000)))
+            self.write_response(message)
         else:
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
+# Acknowledgement Handlers
+
+class AckHandler(BaseHandler):
+    def put(self, queue):
+        ''' Acknowledge leased messages (one id per line in request body). '''
+        acknowledged = 0
+        for identifier in self.request.body.split():
+            leased = self.application.leases.pop(int(identifier), None)
+            if leased:
+                self.application.settle(*leased)
+                acknowledged += 1
+
+        self.write_response('Acknowledged {} messages from queue ({})\n'.format(acknowledged, queue))
+
+class NackHandler(BaseHandler):
+    def put(self, queue):
+        ''' Return leased messages to the front of their queues. '''
+        returned = 0
+        for identifier in self.request.body.split():
+            if self.application.release(int(identifier)):
+                returned += 1
+
+        self.write_response('Returned {} messages to queue ({})\n'.format(returned, queue))
+
+# Health Handler
+
+class HealthHandler(BaseHandler):
+    def get(self):
+        ''' Report that broker is up (used by clients to probe failed brokers). '''
+        self.write('OK\n')
+
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
@@ -84,8 +423,10 @@ class SubscriptionHandler(BaseHandler):
         ''' Subscribe queue to topic. '''
         try:
             self.application.subscriptions[queue].add(topic)
+            self.application.topics.add(topic, queue)
             if queue not in self.application.queues:
                 self.application.queues[queue]
+            self.application.save_subscriptions()
         except KeyError:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
@@ -95,6 +436,8 @@ class SubscriptionHandler(BaseHandler):
         ''' Unsubscribe queue from topic. '''
         try:
             self.application.subscriptions[queue].remove(topic)
+            self.application.topics.remove(topic, queue)
+            self.application.save_subscriptions()
         except KeyError:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
@@ -105,6 +448,9 @@ class SubscriptionHandler(BaseHandler):
 class MessageQueue(tornado.web.Application):
     DEFAULT_ADDRESS = '0.0.0.0'
     DEFAULT_PORT    = 9620
+    CHECKPOINT_MS   = 1000
+    SUBSCRIPTIONS   = 'subscriptions.json'
+    EPOCH           = 'epoch'
 
     def __init__(self, **settings):
         tornado.web.Application.__init__(self, **settings)
@@ -113,15 +459,120 @@ class MessageQueue(tornado.web.Application):
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(collections.deque)
+        self.data          = settings.get('data')
         self.subscriptions = collections.defaultdict(set)
+        self.topics        = TopicTrie()
+        self.leases        = {}     # id -> (queue, (message, trace, expires))
+        self.expirations   = []     # heap of (deadline, id)
+        self.next_lease    = 1
+
+        if self.data:
+            self.queues = SegmentQueues(self.data)
+            self.load_subscriptions()
+        else:
+            self.queues = collections.defaultdict(collections.deque)
+        self.epoch = self.load_epoch()
 
         self.add_handlers('.*', (
             ('.*/topic/(.*)'            , TopicHandler),
             ('.*/queue/(.*)'            , QueueHandler),
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
+            ('.*/ack/(.*)'              , AckHandler),
+            ('.*/nack/(.*)'             , NackHandler),
+            ('.*/health'                , HealthHandler),
         ))
 
+    def load_subscriptions(self):
+        ''' Restore subscriptions saved in data directory. '''
+        try:
+            with open(os.path.join(self.data, self.SUBSCRIPTIONS)) as stream:
+                for queue, topics in json.load(stream).items():
+                    for topic in topics:
+                        self.subscriptions[queue].add(topic)
+                        self.topics.add(topic, queue)
+                    self.queues[queue]
+        except (IOError, ValueError):
+            pass
+
+    def load_epoch(self):
+        ''' Return epoch that prefixes lease ids (one greater than last run's, if persistent). '''
+        epoch = int(time.time()) & 0xffffffff
+        if not self.data:
+            return epoch
+        path = os.path.join(self.data, self.EPOCH)
+        try:
+            with open(path) as stream:
+                epoch = max(epoch, (int(stream.read().strip() or 0) + 1) & 0xffffffff)
+        except (IOError, ValueError):
+            pass
+        with open(path + '.tmp', 'w') as stream:
+            stream.write(str(epoch))
+        os.replace(path + '.tmp', path)
+        return epoch
+
+    def save_subscriptions(self):
+        ''' Atomically save subscriptions to data directory (if persistent). '''
+        if not self.data:
+            return
+        temporary = os.path.join(self.data, self.SUBSCRIPTIONS + '.tmp')
+        with open(temporary, 'w') as stream:
+            json.dump({queue: sorted(topics) for queue, topics in self.subscriptions.items()}, stream)
+        os.replace(temporary, os.path.join(self.data, self.SUBSCRIPTIONS))
+
+    def checkpoint(self):
+        ''' Record read offsets of persistent queues. '''
+        if self.data:
+            self.queues.checkpoint()
+
+    def pop(self, queue):
+        ''' Remove and return oldest unexpired message in queue (None if empty).
+
+        Expired messages are dropped as they reach the front, so each one is
+        looked at once and never costs more than that.
+        '''
+        messages = self.queues[queue]
+        now      = None
+        while messages:
+            item = messages.popleft()
+            if item[2]:
+                now = now or time.time()
+                if item[2] <= now:
+                    self.settle(queue, item)
+                    continue
+            return item
+        return None
+
+    def settle(self, queue, item):
+        ''' Mark message as done with, so the checkpoint may move past it. '''
+        if self.data:
+            self.queues[queue].settle(item)
+
+    def lease(self, queue, item, milliseconds):
+        ''' Record message as leased until acknowledged or lease expires.
+
+        Ids are prefixed with the server's epoch, so that an id leased before
+        a restart never matches a lease made after it.
+        '''
+        identifier       = (self.epoch << 32) | (self.next_lease & 0xffffffff)
+        self.next_lease += 1
+        self.leases[identifier] = (queue, item)
+        heapq.heappush(self.expirations, (time.monotonic() + milliseconds / 1000.0, identifier))
+        return identifier
+
+    def release(self, identifier):
+        ''' Return leased message to the front of its queue. '''
+        leased = self.leases.pop(identifier, None)
+        if leased:
+            queue, item = leased
+            self.queues[queue].appendleft(item)
+        return leased is not None
+
+    def expire_leases(self):
+        ''' Return messages whose leases expired (acknowledged ones are skipped). '''
+        now = time.monotonic()
+        while self.expirations and self.expirations[0][0] <= now:
+            self.release(heapq.heappop(self.expirations)[1])
+
     def run(self):
         try:
             self.listen(self.port, self.address)
@@ -129,6 +580,10 @@ class MessageQueue(tornado.web.Application):
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
 
+        if self.data:
+            atexit.register(self.checkpoint)
+            tornado.ioloop.PeriodicCallback(self.checkpoint, self.CHECKPOINT_MS).start()
+
         self.ioloop.start()
 
 # Main execution
@@ -137,6 +592,7 @@ def main():
     tornado.options.define('debug'  , default=False, help='Enable debugging mode')
     tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
     tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('data'   , default=None, help='Directory to store persistent queues in.')
     tornado.options.parse_command_line()
 
     signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
@@ -22,7 +22,7 @@ find_port() {
 cleanup() {
     STATUS=${1:-$FAILURES}
     kill $SERVERPID
-    rm -fr $WORKSPACE
+    rm -fr $WORKSPACE /dev/shm/smq.$FUNCTIONAL.$(id -u)
     exit $STATUS
 }
 
@@ -58,4 +58,24 @@ else
     echo "Success"
 fi
 
+printf " %-60s ... " "url: smq://local"
+valgrind --leak-check=full bin/$FUNCTIONAL smq://local &> $WORKSPACE/test
+if [ $? -ne 0 ]; then
+    error "Failure (Exit Code)"
+elif [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure (Valgrind)"
+else
+    echo "Success"
+fi
+
+printf " %-60s ... " "url: smq://shm/$FUNCTIONAL"
+valgrind --leak-check=full bin/$FUNCTIONAL smq://shm/$FUNCTIONAL.$(id -u) &> $WORKSPACE/test
+if [ $? -ne 0 ]; then
+    error "Failure (Exit Code)"
+elif [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure (Valgrind)"
+else
+    echo "Success"
+fi
+
 echo
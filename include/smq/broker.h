@@ -0,0 +1,49 @@
+/* broker.h: SMQ In-Process Broker */
+
+#ifndef SMQ_BROKER_H
+#define SMQ_BROKER_H
+
+#include "smq/queue.h"
+#include "smq/thread.h"
+
+#include <stdbool.h>
+
+/* Structures */
+
+typedef struct Topic Topic;
+struct Topic {
+    char    *name;          // Topic the mailbox is subscribed to
+    Topic   *next;          // Pointer to next Topic in sequence
+};
+
+typedef struct Mailbox Mailbox;
+struct Mailbox {
+    char    *name;          // Name of message queue
+    Topic   *topics;        // Topics this queue is subscribed to
+    Queue   *messages;      // Messages waiting to be retrieved
+    bool     stalled;       // Whether last delivery found mailbox full (so the next does not wait)
+    Mailbox *next;          // Pointer to next Mailbox in sequence
+};
+
+typedef struct Broker Broker;
+struct Broker {
+    Mailbox *mailboxes;     // Message queues known to broker
+    Mutex    lock;          // Protects mailboxes and topics
+};
+
+/* Functions */
+
+Broker *    broker_create();
+void        broker_delete(Broker *b);
+
+size_t      broker_publish(Broker *b, const char *topic, const char *body);
+char *      broker_retrieve(Broker *b, const char *queue, long timeout);
+
+bool        broker_subscribe(Broker *b, const char *queue, const char *topic);
+bool        broker_unsubscribe(Broker *b, const char *queue, const char *topic);
+
+char *      broker_handle(Broker *b, Request *r, long timeout);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,26 @@
+/* bucket.h: SMQ Lock-Free Token Bucket */
+
+#ifndef SMQ_BUCKET_H
+#define SMQ_BUCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Structures */
+
+typedef struct {
+    uint64_t    interval;       // Nanoseconds per token (0 for unlimited)
+    uint64_t    tolerance;      // Nanoseconds a burst may run ahead of the rate
+    uint64_t    tat;            // Theoretical arrival time of next token (CLOCK_MONOTONIC ns)
+} Bucket;
+
+/* Functions */
+
+void        bucket_init(Bucket *b, double rate, size_t burst);
+uint64_t    bucket_take(Bucket *b, uint64_t now, bool reserve);
+void        bucket_refund(Bucket *b);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
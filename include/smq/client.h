@@ -3,43 +3,180 @@
 #ifndef SMQ_CLIENT_H
 #define SMQ_CLIENT_H
 
+#include "smq/bucket.h"
+#include "smq/endpoint.h"
 #include "smq/queue.h"
+#include "smq/trace.h"
+#include "smq/wheel.h"
 
 #include <netdb.h>
 #include <stdbool.h>
 #include <time.h>
 
+/* Constants */
+
+#define SMQ_DISABLED        (-1)    // Turns off a tunable whose 0 selects the default (ie. retries)
+
 /* Structures */
 
+typedef struct Delivery Delivery;
+struct Delivery {
+    const char *message;        // Message body returned by smq_retrieve
+    uint64_t    id;             // Broker id of leased message
+    Deadline    expires;        // When broker lease expires
+    size_t      endpoint;       // 1 + index of broker that leased message
+    Delivery   *next;           // Pointer to next Delivery in sequence
+};
+
+typedef struct {
+    char   *ids;                // Newline separated message ids to settle
+    size_t  length;             // Length of ids string
+    size_t  count;              // Number of ids in string
+    size_t  requests;           // Number of flush Requests in outgoing
+} Settlements;
+
+typedef struct SMQQueue SMQQueue;
+struct SMQQueue {
+    char       *name;           // Name of broker queue
+    size_t      weight;         // Turns per round of weighted round-robin
+    long        current;        // Credit in current round (smooth weighted round-robin)
+    Queue      *incoming;       // Messages fetched from queue (the client's own if merged)
+    SMQQueue   *next;           // Pointer to next SMQQueue in rotation
+};
+
+typedef struct Throttle Throttle;
+struct Throttle {
+    char       *topic;          // Topic pattern limited (NULL for every message of client)
+    Bucket      bucket;         // Rate and burst of messages
+    bool        reject;         // Whether to drop messages over the limit (or delay them)
+    size_t      delayed;        // Messages held back so far
+    size_t      rejected;       // Messages dropped so far
+    Throttle   *next;           // Pointer to next Throttle in list
+};
+
+typedef struct {
+    const char *name;           // Thread name shown by top and perf (NULL for default)
+    const char *cpus;           // CPUs thread may run on, ie. "0-3,8" (NULL for any)
+    size_t      stack_size;     // Stack size in bytes (0 for default)
+    int         policy;         // Scheduling policy, ie. SCHED_FIFO (0 for default)
+    int         priority;       // Scheduling priority for policy
+} SMQThreadConfig;
+
+typedef struct {
+    const char     *name;       // Name of client's queue
+    const char     *host;       // Comma separated brokers: hosts, host:port, or URLs (ie. smq://local)
+    const char     *port;       // Port of brokers that do not name one
+    bool            partition;  // Spread topics over brokers instead of failing over (SMQ_PARTITION)
+    const char     *snapshot;   // File to restore pending messages from (SMQ_SNAPSHOT, NULL for none)
+    const char     *queues;     // More queues to consume: name[:weight],... (SMQ_QUEUES, merged)
+
+    SMQThreadConfig pusher;     // Threads that send outgoing Requests
+    SMQThreadConfig puller;     // Threads that fetch incoming messages
+
+    // Tunables (0 selects the default unless noted, SMQ_* environment variables override)
+    size_t  capacity;           // Requests per internal queue (SMQ_CAPACITY)
+    size_t  max_bytes;          // Body bytes per internal queue (SMQ_MAX_BYTES)
+    time_t  timeout;            // Transfer and retrieve timeout in ms (SMQ_TIMEOUT)
+    time_t  connect_timeout;    // Connect timeout in ms (SMQ_CONNECT_TIMEOUT)
+    size_t  pushers;            // Number of pusher threads (SMQ_PUSHERS)
+    size_t  pullers;            // Number of puller threads (SMQ_PULLERS)
+    size_t  batch;              // Maximum ids per ack or nack Request (SMQ_BATCH)
+    size_t  retries;            // Times to resend failed Request (SMQ_RETRIES, SMQ_DISABLED for none)
+    time_t  backoff;            // Delay before first resend in ms (SMQ_BACKOFF, SMQ_DISABLED for none)
+    size_t  failures;           // Consecutive failures that take a broker out (SMQ_FAILURES)
+    time_t  cooldown;           // Time before failed broker is probed in ms (SMQ_COOLDOWN)
+    size_t  vnodes;             // Virtual nodes per broker on hash ring (SMQ_VNODES)
+    time_t  ttl;                // Time published messages live in ms (SMQ_TTL, 0 for forever)
+    size_t  rate;               // Messages published per second (SMQ_RATE, 0 for unlimited)
+    size_t  burst;              // Messages published at once within rate (SMQ_BURST)
+} SMQConfig;
+
 typedef struct {
-    char    name[1<<8];         // Name of message queue
-    char    server_url[1<<8];   // URL of server
+    char   *name;               // Name of message queue
+    Endpoints *endpoints;       // Brokers (with circuit breakers)
+    bool    partitioned;        // Whether topics are spread over brokers by hash
 
     time_t  timeout;            // Socket timeout (milliseconds)
+    time_t  connect_timeout;    // Connect timeout (milliseconds)
     bool    running;            // Whether or not SMQ is running (active)
 
     Queue*  outgoing;           // Requests to be sent to server
+    Queue** lanes;              // Outgoing queue of each pusher, outgoing first (NULL unless partitioned)
+    size_t  nlanes;             // Number of lanes (one per pusher)
     Queue*  incoming;           // Requests received from server
-
-    // TODO: Add any necessary thread and synchromization primitives
-
-    Thread  pusher;
-    Thread  puller;
+    SMQQueue *queues;           // Broker queues pullers take turns fetching from (name first)
+    size_t  nqueues;            // Number of queues (protected by lock)
+    Wheel*  scheduled;          // Requests waiting for their send time
+
+    Thread *pushers;            // Threads sending outgoing Requests
+    size_t  npushers;
+    Thread *pullers;            // Threads fetching incoming messages
+    size_t  npullers;
+    size_t  started;            // Pullers started so far (each takes next broker)
+    size_t  pushing;            // Pushers started so far (each takes next lane)
+    Thread  timer;              // Thread moving due scheduled Requests to outgoing
+    bool    timing;             // Whether timer thread was started
+
+    size_t  batch;              // Maximum ids per ack or nack Request
+    size_t  retries;            // Times to resend failed Request
+    time_t  backoff;            // Delay before first resend (milliseconds)
+    time_t  ttl;                // Time published messages live (milliseconds, 0 for forever)
+    Throttle *throttles;        // Rate limits enforced by pushers (newest first)
+
+    Tracer  tracer;             // Sampled per-stage message latencies
+
+    size_t      prefetch;       // Maximum unacknowledged messages (0 disables leases)
+    time_t      lease;          // Time broker waits for acknowledgement (milliseconds)
+    size_t      unacked;        // Messages leased but not yet acknowledged
+    Delivery   *deliveries;     // Retrieved messages awaiting acknowledgement
+    Settlements *acks;          // Acknowledgements waiting to be sent (per broker)
+    Settlements *nacks;         // Negative acknowledgements waiting to be sent (per broker)
+    Request    *unsent;         // Requests pushers gave up on at shutdown (kept for smq_snapshot)
+    Mutex       lock;           // Protects acknowledgement state (and unsent)
+    Cond        window;         // Signaled when prefetch window opens
+    Cond        stopped;        // Broadcast at shutdown (wakes pushers backing off)
 
 } SMQ;
 
 SMQ *   smq_create(const char *name, const char *host, const char *port);
+SMQ *   smq_create_ex(const SMQConfig *config);
 void    smq_delete(SMQ *smq);
 
 void    smq_publish(SMQ *smq, const char *topic, const char *body);
+void    smq_publish_conflated(SMQ *smq, const char *topic, const char *key, const char *body);
+bool    smq_publish_until(SMQ *smq, const char *topic, const char *body, Deadline deadline);
+bool    smq_publish_ttl(SMQ *smq, const char *topic, const char *body, time_t ttl);
+bool    smq_publish_at(SMQ *smq, const char *topic, const char *body, Deadline due);
+bool    smq_schedule(SMQ *smq, Request *request, Deadline due);
+Queue * smq_outgoing(SMQ *smq, const Request *request);
 char *  smq_retrieve(SMQ *smq);
+char *  smq_retrieve_until(SMQ *smq, Deadline deadline);
+char *  smq_retrieve_from(SMQ *smq, const char *queue, Deadline deadline);
 
 void    smq_subscribe(SMQ *smq, const char *topic);
 void    smq_unsubscribe(SMQ *smq, const char *topic);
+void    smq_subscribe_queue(SMQ *smq, const char *queue, const char *topic);
+void    smq_unsubscribe_queue(SMQ *smq, const char *queue, const char *topic);
+
+bool    smq_attach(SMQ *smq, const char *queue, size_t weight, bool merged);
 
 bool    smq_running(SMQ *smq);
 void    smq_shutdown(SMQ *smq);
 
+bool    smq_snapshot(SMQ *smq, const char *path);
+ssize_t smq_restore(SMQ *smq, const char *path);
+
+void    smq_limit(SMQ *smq, size_t bytes);
+bool    smq_throttle(SMQ *smq, const char *topic, double rate, size_t burst, bool reject);
+void    smq_credit(SMQ *smq, size_t credits);
+
+void    smq_prefetch(SMQ *smq, size_t window, time_t lease);
+void    smq_ack(SMQ *smq, const char *message);
+void    smq_nack(SMQ *smq, const char *message);
+
+void                smq_trace(SMQ *smq, size_t rate);
+const Histogram *   smq_latency(SMQ *smq, TraceStage stage);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
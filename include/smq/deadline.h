@@ -0,0 +1,31 @@
+/* deadline.h: SMQ Monotonic Deadlines */
+
+#ifndef SMQ_DEADLINE_H
+#define SMQ_DEADLINE_H
+
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Constants */
+
+#define DEADLINE_NEVER  UINT64_MAX      // Deadline that never passes
+
+/* Structures */
+
+typedef uint64_t Deadline;              // Absolute CLOCK_MONOTONIC time (ns)
+
+/* Functions */
+
+Deadline        deadline_after(long timeout);
+bool            deadline_expired(Deadline deadline);
+long            deadline_remaining(Deadline deadline);
+struct timespec deadline_timespec(Deadline deadline);
+
+int             deadline_wait(Cond *cond, Mutex *lock, Deadline deadline);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,54 @@
+/* endpoint.h: SMQ Broker Endpoints (with circuit breakers) */
+
+#ifndef SMQ_ENDPOINT_H
+#define SMQ_ENDPOINT_H
+
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Structures */
+
+typedef struct {
+    char       *url;            // Base URL of broker (ie. http://host:port)
+    size_t      failures;       // Consecutive failed Requests
+    uint64_t    retry_at;       // When open circuit may be probed (CLOCK_MONOTONIC ns, 0 if closed)
+    uint64_t    cooldown;       // Time circuit stays open when it next trips (ns)
+    bool        probing;        // Whether a health check of open circuit is in progress
+} Endpoint;
+
+typedef struct {
+    uint64_t    hash;           // Position on hash ring
+    size_t      index;          // Endpoint that owns keys up to this position
+} EndpointNode;
+
+typedef struct {
+    Endpoint   *endpoints;      // Brokers in order of preference
+    size_t      count;          // Number of endpoints
+    size_t      cursor;         // Next endpoint to hand out when rotating
+    size_t      threshold;      // Consecutive failures that open a circuit
+    uint64_t    cooldown;       // Initial time circuit stays open (ns)
+    EndpointNode *ring;         // Virtual nodes sorted by hash (NULL unless partitioned)
+    size_t      nodes;          // Number of virtual nodes on ring
+    Mutex       lock;
+} Endpoints;
+
+/* Functions */
+
+Endpoints * endpoints_create(const char *hosts, const char *port, size_t threshold, time_t cooldown);
+void        endpoints_delete(Endpoints *e);
+
+bool        endpoints_partition(Endpoints *e, size_t vnodes);
+
+ssize_t     endpoints_acquire(Endpoints *e, bool rotate, bool *probe);
+ssize_t     endpoints_owner(Endpoints *e, const char *key, bool *probe);
+size_t      endpoints_home(Endpoints *e, const char *key);
+bool        endpoints_check(Endpoints *e, size_t index, bool *probe);
+void        endpoints_report(Endpoints *e, size_t index, bool healthy);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,132 @@
+/* probe.h: SMQ Compile-Time Optional Trace Points */
+
+#ifndef SMQ_PROBE_H
+#define SMQ_PROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Constants */
+
+#ifndef PROBE_EVENTS
+#define PROBE_EVENTS    (1<<16)         // Events kept per thread (power of 2)
+#endif
+
+#ifndef PROBE_RINGS
+#define PROBE_RINGS     (64)            // Rings kept before unexported ones are reused
+#endif
+
+/* Structures */
+
+typedef enum {
+    PROBE_QUEUE_PUSH,       // queue_push_until waiting for room
+    PROBE_QUEUE_POP,        // queue_pop_until waiting for a Request
+    PROBE_QUEUE_RESERVE,    // queue_reserve waiting for credit
+    PROBE_THROTTLE,         // Pusher waiting for rate limits
+    PROBE_SEND,             // smq_send retrying (backoff and failover after a failed attempt)
+    PROBE_BACKOFF,          // smq_backoff
+    PROBE_CURL,             // curl_easy_perform
+    PROBE_WRITER,           // request_writer growing response buffer
+    PROBE_STAGES,
+} ProbeStage;
+
+typedef enum {
+    PROBE_RING_RUNNING,     // Thread is recording into ring
+    PROBE_RING_EXITED,      // Thread exited, and its events await probe_export
+    PROBE_RING_EXPORTING,   // probe_export is writing events of exited thread
+    PROBE_RING_IDLE,        // Events were exported, so ring may be reused
+} ProbeRingState;
+
+typedef struct {
+    uint64_t    clock;      // probe_clock() when event happened
+    uint32_t    stage;      // ProbeStage
+    uint32_t    phase;      // 'B' when stage begins, 'E' when it ends
+} ProbeEvent;
+
+typedef struct ProbeRing ProbeRing;
+struct ProbeRing {
+    ProbeEvent  events[PROBE_EVENTS];
+    uint64_t    head;       // Events recorded so far (oldest are overwritten)
+    int         thread;     // Kernel thread id
+    char        name[16];   // Thread name (ie. smq-pusher-0)
+    int         state;      // ProbeRingState
+    ProbeRing  *next;       // Pointer to ring of next thread
+};
+
+/* Functions */
+
+bool        probe_export(const char *path);
+
+/* Trace Points
+ *
+ * probe_scope(stage) marks the rest of the enclosing block as stage, and
+ * probe_begin and probe_end mark any other span.  Unless the library is built
+ * with SMQ_PROBES (make PROBES=1), they expand to nothing at all.
+ *
+ * Each event costs a timestamp (about 20ns), so stages are only marked where
+ * a thread waits or retries, never on the path every message takes: there
+ * is deliberately no stage for request_create, smq_publish, or smq_retrieve.
+ */
+
+#ifdef SMQ_PROBES
+
+extern __thread ProbeRing *probe_ring;
+
+ProbeRing * probe_attach();
+
+/**
+ * Return cheap timestamp (TSC where available, else CLOCK_MONOTONIC ns).
+ **/
+static inline uint64_t probe_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Append event to calling thread's ring (which only that thread writes).
+ **/
+static inline void probe_record(ProbeStage stage, uint32_t phase) {
+    ProbeRing *ring = probe_ring ? probe_ring : probe_attach();
+    if (!ring) return;
+
+    ProbeEvent *event = &ring->events[ring->head & (PROBE_EVENTS - 1)];
+    event->clock = probe_clock();
+    event->stage = stage;
+    event->phase = phase;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static inline ProbeStage probe_enter(ProbeStage stage) {
+    probe_record(stage, 'B');
+    return stage;
+}
+
+static inline void probe_leave(ProbeStage *stage) {
+    probe_record(*stage, 'E');
+}
+
+#define PROBE_CONCAT(a, b)      a ## b
+#define PROBE_NAME(line)        PROBE_CONCAT(probe_scope_, line)
+
+#define probe_scope(stage)      __attribute__((cleanup(probe_leave))) \
+                                ProbeStage PROBE_NAME(__LINE__) = probe_enter(stage)
+#define probe_begin(stage)      probe_record(stage, 'B')
+#define probe_end(stage)        probe_record(stage, 'E')
+
+#else
+
+#define probe_scope(stage)      ((void)0)
+#define probe_begin(stage)      ((void)0)
+#define probe_end(stage)        ((void)0)
+
+#endif
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,11 +3,11 @@
 #ifndef SMQ_QUEUE_H
 #define SMQ_QUEUE_H
 
+#include "smq/deadline.h"
 #include "smq/request.h"
 #include "smq/thread.h"
 
 #include <stdbool.h>
-#include <semaphore.h>
 #include <time.h>
 
 /* Structures */
@@ -19,9 +19,26 @@ struct Queue {
     size_t   size;
     bool     running;
 
-    sem_t    lock;
-    sem_t    consumed;
-    sem_t    produced;
+    size_t   capacity;      // Maximum number of Requests
+    size_t   reserved;      // Slots promised by queue_reserve but not yet filled
+
+    size_t   bytes;         // Total body bytes of queued Requests
+    size_t   max_bytes;     // Maximum body bytes (0 for unlimited)
+    size_t   high;          // Producers block once bytes reaches this
+    size_t   low;           // ... until bytes drains back down to this
+    bool     throttled;     // Whether high watermark has been crossed
+
+    Request **index;        // Hash buckets of keyed Requests (by url and key)
+    size_t   buckets;       // Number of hash buckets
+    size_t   keyed;         // Number of keyed Requests in index
+
+    size_t   expired;       // Requests dropped because their deadline passed
+    void   (*expire)(Request *r, void *arg);  // Takes dropped Requests (NULL to delete them)
+    void    *expire_arg;    // Argument passed to expire
+
+    Mutex    lock;
+    Cond     consumed;
+    Cond     produced;
 };
 
 /* Functions */
@@ -30,9 +47,20 @@ Queue *     queue_create();
 void        queue_delete(Queue *q);
 
 void        queue_shutdown(Queue *q);
+void        queue_limit(Queue *q, size_t max_bytes, size_t high, size_t low);
+void        queue_capacity(Queue *q, size_t capacity);
+void        queue_expire(Queue *q, void (*expire)(Request *r, void *arg), void *arg);
 
-void        queue_push(Queue *q, Request *r);
+bool        queue_push(Queue *q, Request *r);
+bool        queue_push_until(Queue *q, Request *r, Deadline deadline);
 Request *   queue_pop(Queue *q, time_t timeout);
+Request *   queue_pop_until(Queue *q, Deadline deadline);
+bool        queue_writable(Queue *q, time_t timeout);
+
+bool        queue_reserve(Queue *q, time_t timeout);
+bool        queue_reserve_until(Queue *q, Deadline deadline);
+bool        queue_commit(Queue *q, Request *r);
+void        queue_release(Queue *q);
 
 #endif
 
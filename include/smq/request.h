@@ -3,6 +3,14 @@
 #ifndef SMQ_REQUEST_H
 #define SMQ_REQUEST_H
 
+#include "smq/deadline.h"
+#include "smq/trace.h"
+
+/* Constants */
+
+#define MESSAGE_HEADER  "X-SMQ-Message" // Header carrying leased message id
+#define TTL_HEADER      "X-SMQ-TTL"     // Header carrying milliseconds message has left to live
+
 /* Structures */
 
 typedef struct Request Request;
@@ -10,8 +18,20 @@ struct Request {
     char    *method;    // Method string performed by Request
     char    *url;       // URL string to send with Request
     char    *body;      // Body string to send in Request
+    size_t   length;    // Length of body (set along with it, so queues never measure it)
+    size_t   received;  // Length of response body returned by last request_perform
 
     Request *next;      // Pointer to next Request in sequence
+    Trace   *trace;     // Latency trace (NULL if Request is not sampled)
+    uint64_t id;        // Broker message id of leased message (0 if none)
+    char    *key;       // Conflation key (NULL if every message is sent)
+    Request *chain;     // Next keyed Request in same Queue index bucket
+    long     connect;   // Connect timeout in ms (0 to use transfer timeout)
+    size_t   endpoint;  // 1 + index of broker endpoint Request must use (0 for any)
+    bool     offline;   // Whether last perform could not reach the broker
+    Deadline deadline;  // When Request (or message) is no longer worth performing (0 for none)
+    Deadline due;       // When scheduled Request moves to outgoing (0 if not scheduled)
+    bool     throttled; // Whether Request already took its rate limit tokens (and was deferred)
 };
 
 /* Functions */
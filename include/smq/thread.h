@@ -41,6 +41,8 @@ typedef pthread_cond_t              Cond;
 #define cond_wait(c, l)             PTHREAD_CHECK(pthread_cond_wait(c, l))
 #define cond_timedwait(c, l, t)     PTHREAD_CHECK(pthread_cond_timedwait(c, l, t))
 #define cond_signal(c)              PTHREAD_CHECK(pthread_cond_signal(c))
+#define cond_broadcast(c)           PTHREAD_CHECK(pthread_cond_broadcast(c))
+#define cond_destroy(c)             PTHREAD_CHECK(pthread_cond_destroy(c))
 
 #endif
 
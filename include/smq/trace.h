@@ -0,0 +1,61 @@
+/* trace.h: SMQ Per-Message Latency Tracing */
+
+#ifndef SMQ_TRACE_H
+#define SMQ_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define TRACE_HEADER    "X-SMQ-Trace"   // Header used to propagate Trace
+#define TRACE_BUCKETS   (32)            // Log2 microsecond histogram buckets
+
+/* Structures */
+
+typedef enum {
+    TRACE_PUBLISH,      // smq_publish placed Request in outgoing queue
+    TRACE_DEQUEUE,      // Pusher removed Request from outgoing queue
+    TRACE_SENT,         // Pusher finished sending Request to broker
+    TRACE_BROKER,       // Broker received message
+    TRACE_RECEIVE,      // Puller received message from broker
+    TRACE_RETRIEVE,     // smq_retrieve removed message from incoming queue
+    TRACE_STAGES,
+} TraceStage;
+
+typedef struct {
+    uint64_t    stamps[TRACE_STAGES];   // CLOCK_MONOTONIC nanoseconds (0 if unknown)
+} Trace;
+
+typedef struct {
+    uint64_t    count;                  // Number of samples
+    uint64_t    total;                  // Sum of samples (nanoseconds)
+    uint64_t    buckets[TRACE_BUCKETS]; // Samples by log2 of microseconds
+} Histogram;
+
+typedef struct {
+    uint64_t    rate;                   // Trace 1 in rate messages (0 disables)
+    uint64_t    sequence;               // Messages considered for sampling
+    Histogram   stages[TRACE_STAGES];   // Latency of each stage from the previous one
+} Tracer;
+
+/* Functions */
+
+uint64_t    trace_now();
+
+Trace *     trace_create();
+Trace *     trace_copy(const Trace *t);
+void        trace_stamp(Trace *t, TraceStage stage);
+
+char *      trace_format(const Trace *t, char *buffer, size_t size);
+Trace *     trace_parse(Trace *t, const char *header);
+
+bool        tracer_sample(Tracer *tracer);
+void        tracer_record(Tracer *tracer, const Trace *t, TraceStage stage);
+
+uint64_t    histogram_percentile(const Histogram *h, double percentile);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,52 @@
+/* transport.h: SMQ Transport interface */
+
+#ifndef SMQ_TRANSPORT_H
+#define SMQ_TRANSPORT_H
+
+#include "smq/request.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Structures */
+
+typedef enum {
+    ROUTE_UNKNOWN,          // Request does not match REST API
+    ROUTE_PUBLISH,          // PUT     /topic/$topic
+    ROUTE_RETRIEVE,         // GET     /queue/$queue
+    ROUTE_SUBSCRIBE,        // PUT     /subscription/$queue/$topic
+    ROUTE_UNSUBSCRIBE,      // DELETE  /subscription/$queue/$topic
+    ROUTE_ACK,              // PUT     /ack/$queue
+    ROUTE_NACK,             // PUT     /nack/$queue
+    ROUTE_HEALTH,           // GET     /health
+} Route;
+
+typedef struct Transport Transport;
+struct Transport {
+    const char *    scheme;                             // URL prefix handled by Transport
+    char *        (*perform)(Request *r, long timeout); // Perform Request and return response body
+};
+
+/* Transports */
+
+extern const Transport HTTPTransport;
+extern const Transport H2CTransport;
+extern const Transport LocalTransport;
+extern const Transport SHMTransport;
+
+/* Functions */
+
+const Transport *   transport_lookup(const char *url);
+const char *        transport_path(const char *url);
+Route               transport_route(const char *method, const char *path, char **queue, char **topic);
+char *              transport_response(const char *format, ...);
+
+long                transport_query(const char *path, const char *name, long value);
+
+bool                transport_match(const char *pattern, const char *topic);
+char *              transport_escape(char *buffer, size_t size, const char *s);
+char *              transport_unescape(char *s);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -29,14 +29,6 @@
 #define min(a, b)           ((a) < (b) ? (a) : (b))
 #define streq(a, b)         (strcmp(a, b) == 0)
 
-#define compute_stoptime(ts, timeout) \
-    do { \
-        clock_gettime(CLOCK_REALTIME, &ts); \
-        ts.tv_nsec += (timeout % 1000) * 1000000; \
-        ts.tv_sec  += (timeout / 1000) + (ts.tv_nsec % 1000000000) / 1000000000; \
-        ts.tv_nsec = ts.tv_nsec % 1000000000; \
-    } while(0);
-
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,55 @@
+/* wheel.h: SMQ Hierarchical Timer Wheel of Requests */
+
+#ifndef SMQ_WHEEL_H
+#define SMQ_WHEEL_H
+
+#include "smq/deadline.h"
+#include "smq/request.h"
+#include "smq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define WHEEL_BITS      (8)                     // Slots per level (log2)
+#define WHEEL_SLOTS     (1<<WHEEL_BITS)
+#define WHEEL_LEVELS    (4)                     // Levels (spanning 2^32 ticks)
+#define WHEEL_TICK      (1000000ULL)            // Nanoseconds per tick
+
+/* Structures */
+
+typedef struct {
+    Request *head;
+    Request *tail;
+} WheelSlot;
+
+typedef struct Wheel Wheel;
+struct Wheel {
+    WheelSlot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+    uint64_t start;         // CLOCK_MONOTONIC ns of tick 0
+    uint64_t tick;          // Next tick to expire
+    uint64_t wake;          // Tick waiter sleeps until (UINT64_MAX if none)
+    size_t   size;          // Number of scheduled Requests
+    size_t   capacity;      // Maximum number of scheduled Requests
+    bool     running;
+
+    Mutex    lock;
+    Cond     changed;       // Signaled when an earlier Request is added
+};
+
+/* Functions */
+
+Wheel *     wheel_create();
+void        wheel_delete(Wheel *w);
+
+void        wheel_shutdown(Wheel *w);
+void        wheel_capacity(Wheel *w, size_t capacity);
+
+bool        wheel_add(Wheel *w, Request *r, Deadline due);
+Request *   wheel_take(Wheel *w, Deadline deadline);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
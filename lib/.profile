@@ -0,0 +1 @@
+debug 0
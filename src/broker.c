@@ -0,0 +1,412 @@
+/* broker.c: SMQ In-Process Broker */
+
+#include "smq/broker.h"
+#include "smq/transport.h"
+#include "smq/utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Internal Functions */
+
+/**
+ * Find Mailbox with specified name (broker lock must be held).
+ * @param   b           Broker structure.
+ * @param   queue       Name of message queue.
+ * @param   create      Whether or not to create Mailbox if it does not exist.
+ * @return  Mailbox structure (NULL if not found or allocation failed).
+ **/
+static Mailbox * broker_mailbox(Broker *b, const char *queue, bool create) {
+    for (Mailbox *m = b->mailboxes; m; m = m->next) {
+        if (streq(m->name, queue)) {
+            return m;
+        }
+    }
+
+    if (!create) return NULL;
+
+    Mailbox *m = calloc(1, sizeof(Mailbox));
+    if (!m) return NULL;
+
+    m->name     = strdup(queue);
+    m->messages = queue_create();
+    if (!m->name || !m->messages) {
+        free(m->name);
+        if (m->messages) queue_delete(m->messages);
+        free(m);
+        return NULL;
+    }
+
+    m->next      = b->mailboxes;
+    b->mailboxes = m;
+    return m;
+}
+
+/**
+ * Return whether or not any of Mailbox's patterns match topic (broker lock must be held).
+ * @param   m           Mailbox structure.
+ * @param   topic       Published topic string.
+ **/
+static bool mailbox_matches(Mailbox *m, const char *topic) {
+    for (Topic *t = m->topics; t; t = t->next) {
+        if (transport_match(t->name, topic)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Return whether or not Mailbox is subscribed to topic (broker lock must be held).
+ * @param   m           Mailbox structure.
+ * @param   topic       Topic string.
+ **/
+static bool mailbox_subscribed(Mailbox *m, const char *topic) {
+    for (Topic *t = m->topics; t; t = t->next) {
+        if (streq(t->name, topic)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Functions */
+
+/**
+ * Create Broker structure.
+ * @return  Newly allocated Broker structure.
+ **/
+Broker * broker_create() {
+    Broker *b = calloc(1, sizeof(Broker));
+
+    if (b) {
+        mutex_init(&b->lock, NULL);
+    }
+
+    return b;
+}
+
+/**
+ * Delete Broker structure (and all of its mailboxes and pending messages).
+ * @param   b           Broker structure.
+ **/
+void broker_delete(Broker *b) {
+    if (!b) return;
+
+    Mailbox *m = b->mailboxes;
+    while (m) {
+        Mailbox *next = m->next;
+
+        Topic *t = m->topics;
+        while (t) {
+            Topic *tnext = t->next;
+            free(t->name);
+            free(t);
+            t = tnext;
+        }
+
+        queue_delete(m->messages);
+        free(m->name);
+        free(m);
+        m = next;
+    }
+
+    mutex_destroy(&b->lock);
+    free(b);
+}
+
+/**
+ * Deliver copy of message (and its trace) to each queue subscribed to topic.
+ *
+ * Note: messages are pushed outside the broker lock so that a full mailbox
+ * only blocks the publisher and not consumers of other queues.  A message
+ * whose deadline passes while it waits in a mailbox is dropped when it
+ * reaches the front, instead of being retrieved.
+ *
+ * Delivery is all or nothing: a slot is reserved in every mailbox first, and
+ * if one is still full once timeout (or the message deadline) passes, no
+ * mailbox gets the message and the publish fails, so the publisher sees the
+ * backpressure (and a retry does not duplicate the message).  That mailbox
+ * is marked stalled, so later messages fail at once rather than wait for it
+ * again until it has room; otherwise an abandoned subscriber would hold up
+ * every publisher (and the pushers of local clients) for a timeout each.
+ *
+ * @param   b           Broker structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body.
+ * @param   trace       Message trace (may be NULL).
+ * @param   deadline    When message expires (0 for never).
+ * @param   timeout     Maximum time to wait for room in each mailbox
+ *                      (milliseconds, negative for no limit).
+ * @return  Number of subscribers that received message (0 if any was full).
+ **/
+static size_t broker_deliver(Broker *b, const char *topic, const char *body, const Trace *trace,
+                             Deadline deadline, long timeout) {
+    if (!b || !topic) return 0;
+    if (!body) body = "";
+
+    mutex_lock(&b->lock);
+    size_t count = 0;
+    for (Mailbox *m = b->mailboxes; m; m = m->next) {
+        count++;
+    }
+
+    Mailbox **targets = calloc(count ? count : 1, sizeof(Mailbox *));
+    size_t    subscribers = 0;
+    if (targets) {
+        for (Mailbox *m = b->mailboxes; m; m = m->next) {
+            if (mailbox_matches(m, topic)) {
+                targets[subscribers++] = m;
+            }
+        }
+    }
+    mutex_unlock(&b->lock);
+
+    Deadline limit = timeout < 0 ? DEADLINE_NEVER : deadline_after(timeout);
+    if (deadline && deadline < limit) limit = deadline;
+
+    size_t reserved = 0;
+    bool   full     = false;
+    for (; reserved < subscribers && !full; reserved++) {
+        Mailbox *m       = targets[reserved];
+        bool     stalled = __atomic_load_n(&m->stalled, __ATOMIC_RELAXED);
+        full = !queue_reserve_until(m->messages, stalled ? deadline_after(0) : limit);
+        if (full && !stalled) {
+            __atomic_store_n(&m->stalled, true, __ATOMIC_RELAXED);
+            error("Mailbox %s is full, failing publishes to it until it has room", m->name);
+        } else if (!full && stalled) {
+            __atomic_store_n(&m->stalled, false, __ATOMIC_RELAXED);
+        }
+    }
+    if (full) reserved--;       // Last mailbox tried has no slot to give back
+
+    size_t delivered = 0;
+    for (size_t i = 0; i < reserved; i++) {
+        Request *message = full ? NULL : request_create(NULL, NULL, body);
+        if (message) {
+            message->trace = trace_copy(trace);
+            trace_stamp(message->trace, TRACE_BROKER);
+            message->deadline = deadline;
+        }
+        if (message && queue_commit(targets[i]->messages, message)) {
+            delivered++;
+        } else {
+            if (!message) queue_release(targets[i]->messages);
+            request_delete(message);
+        }
+    }
+
+    free(targets);
+    return delivered;
+}
+
+/**
+ * Take one message Request from queue (wait up to timeout for one to arrive).
+ *
+ * Note: unlike the HTTP broker, retrieving from an unknown queue creates an
+ * empty mailbox so that pullers block instead of spinning until subscribed.
+ *
+ * @param   b           Broker structure.
+ * @param   queue       Name of message queue.
+ * @param   timeout     Maximum time to wait (milliseconds).
+ * @return  Message Request structure (NULL if none arrived).
+ **/
+static Request * broker_take(Broker *b, const char *queue, long timeout) {
+    if (!b || !queue) return NULL;
+
+    mutex_lock(&b->lock);
+    Mailbox *m = broker_mailbox(b, queue, true);
+    mutex_unlock(&b->lock);
+
+    return m ? queue_pop(m->messages, timeout) : NULL;
+}
+
+/**
+ * Publish message to each queue that is subscribed to topic.
+ * @param   b           Broker structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body.
+ * @return  Number of subscribers that received message.
+ **/
+size_t broker_publish(Broker *b, const char *topic, const char *body) {
+    return broker_deliver(b, topic, body, NULL, 0, -1);
+}
+
+/**
+ * Retrieve one message from queue (wait up to timeout for one to arrive).
+ * @param   b           Broker structure.
+ * @param   queue       Name of message queue.
+ * @param   timeout     Maximum time to wait (milliseconds).
+ * @return  Newly allocated message body (NULL if none arrived).
+ **/
+char * broker_retrieve(Broker *b, const char *queue, long timeout) {
+    Request *r = broker_take(b, queue, timeout);
+    if (!r) return NULL;
+
+    char *body = r->body;
+    r->body = NULL;
+    request_delete(r);
+    return body;
+}
+
+/**
+ * Subscribe queue to topic (which may contain '*' and '#' wildcards).
+ * @param   b           Broker structure.
+ * @param   queue       Name of message queue.
+ * @param   topic       Topic pattern to subscribe to.
+ * @return  Whether or not subscription was recorded.
+ **/
+bool broker_subscribe(Broker *b, const char *queue, const char *topic) {
+    if (!b || !queue || !topic) return false;
+
+    bool result = false;
+    mutex_lock(&b->lock);
+    Mailbox *m = broker_mailbox(b, queue, true);
+    if (m) {
+        if (mailbox_subscribed(m, topic)) {
+            result = true;
+        } else {
+            Topic *t = calloc(1, sizeof(Topic));
+            if (t && (t->name = strdup(topic))) {
+                t->next   = m->topics;
+                m->topics = t;
+                result    = true;
+            } else {
+                free(t);
+            }
+        }
+    }
+    mutex_unlock(&b->lock);
+    return result;
+}
+
+/**
+ * Unsubscribe queue from topic.
+ * @param   b           Broker structure.
+ * @param   queue       Name of message queue.
+ * @param   topic       Topic to unsubscribe from.
+ * @return  Whether or not queue was subscribed to topic.
+ **/
+bool broker_unsubscribe(Broker *b, const char *queue, const char *topic) {
+    if (!b || !queue || !topic) return false;
+
+    bool result = false;
+    mutex_lock(&b->lock);
+    Mailbox *m = broker_mailbox(b, queue, false);
+    if (m) {
+        for (Topic **t = &m->topics; *t; t = &(*t)->next) {
+            if (streq((*t)->name, topic)) {
+                Topic *victim = *t;
+                *t = victim->next;
+                free(victim->name);
+                free(victim);
+                result = true;
+                break;
+            }
+        }
+    }
+    mutex_unlock(&b->lock);
+    return result;
+}
+
+/**
+ * Handle Request using the same REST API as the HTTP broker:
+ *
+ *  PUT     /topic/$topic               Publish message to $topic.
+ *  GET     /queue/$queue               Retrieve one message from $queue.
+ *  PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
+ *  DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+ *  GET     /health                     Report that broker is up.
+ *
+ * GET /queue/$queue?wait=$milliseconds waits at most that long (instead of
+ * timeout) for a message.
+ *
+ * @param   b           Broker structure.
+ * @param   r           Request structure.
+ * @param   timeout     Maximum time to wait for a message (milliseconds).
+ * @return  Newly allocated response body (NULL if error or timeout).
+ **/
+char * broker_handle(Broker *b, Request *r, long timeout) {
+    if (!b || !r || !r->url) return NULL;
+
+    char *queue    = NULL;
+    char *topic    = NULL;
+    char *response = NULL;
+    const char *body = r->body ? r->body : "";
+    size_t subscribers;
+    Request *message;
+    const char *path = transport_path(r->url);
+
+    switch (transport_route(r->method, path, &queue, &topic)) {
+        case ROUTE_PUBLISH:
+            // A publish that found a mailbox full reached none, and fails
+            if ((subscribers = broker_deliver(b, topic, body, r->trace, r->deadline, timeout))) {
+                response = transport_response("Published message (%lu bytes) to %lu subscribers of %s\n",
+                    strlen(body), subscribers, topic);
+            }
+            break;
+        case ROUTE_RETRIEVE:
+            // A client polling several queues asks not to wait long on each
+            if ((message = broker_take(b, queue, min(timeout, transport_query(path, "wait", timeout))))) {
+                // Hand body, trace, and expiry to the retrieving Request
+                response       = message->body;
+                r->received    = message->length;
+                message->body  = NULL;
+                free(r->trace);
+                r->trace       = message->trace;
+                message->trace = NULL;
+                r->deadline    = message->deadline;
+                request_delete(message);
+            }
+            break;
+        case ROUTE_SUBSCRIBE:
+            if (broker_subscribe(b, queue, topic)) {
+                response = transport_response("Subscribed queue (%s) to topic (%s)\n", queue, topic);
+            }
+            break;
+        case ROUTE_UNSUBSCRIBE:
+            if (broker_unsubscribe(b, queue, topic)) {
+                response = transport_response("Unsubscribed queue (%s) from topic (%s)\n", queue, topic);
+            }
+            break;
+        case ROUTE_ACK:
+        case ROUTE_NACK:
+            // Messages are handed over in-process without leases, so there is
+            // nothing to settle
+            response = transport_response("Acknowledged 0 messages from queue (%s)\n", queue);
+            break;
+        case ROUTE_HEALTH:
+            response = transport_response("OK\n");
+            break;
+        default:
+            break;
+    }
+
+    free(queue);
+    free(topic);
+    return response;
+}
+
+/* Local Transport */
+
+static Broker *   LocalBroker = NULL;
+static pthread_once_t LocalBrokerOnce = PTHREAD_ONCE_INIT;
+
+static void local_broker_init() {
+    LocalBroker = broker_create();
+}
+
+/**
+ * Perform Request against the process-wide in-process broker.
+ * @param   r           Request structure.
+ * @param   timeout     Maximum time to wait for a message (milliseconds).
+ * @return  Newly allocated response body (NULL if error or timeout).
+ **/
+static char * local_perform(Request *r, long timeout) {
+    pthread_once(&LocalBrokerOnce, local_broker_init);
+    return broker_handle(LocalBroker, r, timeout);
+}
+
+const Transport LocalTransport = {"smq://local", local_perform};
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
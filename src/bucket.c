@@ -0,0 +1,69 @@
+/* bucket.c: SMQ Lock-Free Token Bucket */
+
+#include "smq/bucket.h"
+
+/* Functions */
+
+/**
+ * Set rate and burst of token bucket (may be called while it is in use).
+ *
+ * The bucket is kept as a single theoretical arrival time (the generic cell
+ * rate algorithm), which behaves exactly like a bucket of burst tokens that
+ * refills at rate, but needs no separate refill step and thus no lock.
+ *
+ * @param   b       Bucket structure.
+ * @param   rate    Tokens per second (0 for unlimited).
+ * @param   burst   Tokens that may be taken at once (0 for 1).
+ **/
+void bucket_init(Bucket *b, double rate, size_t burst) {
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+
+    if (rate > 0 && !interval) interval = 1;
+    if (!burst) burst = 1;
+
+    __atomic_store_n(&b->interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->tolerance, interval * (burst - 1), __ATOMIC_RELAXED);
+}
+
+/**
+ * Take one token from bucket.
+ *
+ * With reserve set, a token that is not available yet is taken anyway, and
+ * the caller must wait until the returned time before using it; otherwise
+ * the bucket is left alone.  Reservations are handed out in order, so
+ * callers that wait for them together still keep to the rate.
+ *
+ * @param   b       Bucket structure.
+ * @param   now     Current time (CLOCK_MONOTONIC ns).
+ * @param   reserve Whether to take a token that is not available yet.
+ * @return  0 if a token was available now, otherwise when it will be (ns).
+ **/
+uint64_t bucket_take(Bucket *b, uint64_t now, bool reserve) {
+    uint64_t interval  = __atomic_load_n(&b->interval, __ATOMIC_RELAXED);
+    uint64_t tolerance = __atomic_load_n(&b->tolerance, __ATOMIC_RELAXED);
+    uint64_t tat       = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    uint64_t start;
+
+    if (!interval) return 0;
+
+    do {
+        start = tat > now ? tat : now;
+        if (start - now > tolerance && !reserve) {
+            return start - tolerance;
+        }
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, start + interval, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return start - now > tolerance ? start - tolerance : 0;
+}
+
+/**
+ * Put back token taken by bucket_take (ie. when the message it was taken
+ * for is dropped after all).
+ * @param   b       Bucket structure.
+ **/
+void bucket_refund(Bucket *b) {
+    __atomic_sub_fetch(&b->tat, __atomic_load_n(&b->interval, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,53 +1,172 @@
 /* client.c: Simple Request Queue Client */
 
+#define _GNU_SOURCE     // CPU_SET, pthread_attr_setaffinity_np, pthread_setname_np
+
 #include "smq/client.h"
+#include "smq/probe.h"
 #include "smq/queue.h"
 #include "smq/thread.h"
 #include "smq/request.h"
+#include "smq/transport.h"
+#include <limits.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdio.h>
 
+/* Constants */
+
+#define SMQ_PORT        "9620"
+#define SMQ_TIMEOUT     (2000)      // Milliseconds
+#define SMQ_LEASE       (30000)     // Milliseconds
+#define SMQ_BATCH       (1024)      // Ids per settlement Request
+#define SMQ_BACKOFF     (100)       // Milliseconds
+#define SMQ_BACKOFF_MAX (10000)     // Milliseconds
+#define SMQ_RETRIES     (3)
+#define SMQ_FAILURES    (3)         // Consecutive failures
+#define SMQ_COOLDOWN    (1000)      // Milliseconds
+#define SMQ_VNODES      (160)       // Virtual nodes per broker
+#define SMQ_WORKERS_MAX (64)        // Pushers or pullers
+#define SMQ_POLL        (100)       // Milliseconds per round of polling idle queues
+
 /* Internal Prototypes */
 
 void * smq_pusher(void *);
 void * smq_puller(void *);
+void * smq_timer(void *);
+
+static Request * smq_message(SMQ *smq, const char *topic, const char *body);
+static char * smq_take(SMQ *smq, Queue *incoming, Deadline deadline);
+static void smq_subscription(SMQ *smq, const char *method, const char *queue, const char *topic);
+static bool smq_attach_list(SMQ *smq, const char *list);
+static bool smq_lanes(SMQ *smq);
+static SMQQueue * smq_rotate(SMQ *smq);
+static void smq_settle(SMQ *smq, const char *message, bool ack);
+static void smq_expire(SMQ *smq);
+static void smq_discard(Request *request, void *arg);
+static void smq_unsent(SMQ *smq, Request *request);
+static bool smq_timer_start(SMQ *smq);
+static bool smq_throttled(SMQ *smq, Request *request);
+static void smq_settlements_take(SMQ *smq, Request *request);
+static bool smq_cpus(const char *cpus, cpu_set_t *set);
+static void smq_thread_start(Thread *thread, const SMQThreadConfig *config, const char *name,
+                             size_t index, size_t count, void *(*function)(void *), SMQ *smq);
+static bool smq_configure(SMQConfig *config);
+static char * smq_url(const char *format, ...);
+static void smq_backoff(SMQ *smq, size_t attempt, Deadline limit);
+static bool smq_probe(SMQ *smq, size_t index);
+static char * smq_send(SMQ *smq, Request *request, const char *key, bool rotate, size_t retries);
 
 /* External Functions */
 
 /**
  * Create Simple Request Queue with specified name, host, and port.
- *
- * - Initialize values.
- * - Create internal queues.
- * - Create pusher and puller threads.
- *
  * @param   name        Name of client's queue.
- * @param   host        Address of server.
- * @param   port        Port of server.
+ * @param   host        Address of server (or URL such as smq://local), or a
+ *                      comma separated list of brokers to fail over between.
+ * @param   port        Port of brokers that do not name one.
  * @return  Newly allocated Simple Request Queue structure.
  **/
 SMQ * smq_create(const char *name, const char *host, const char *port) {
+    SMQConfig config = {
+        .name = name,
+        .host = host,
+        .port = port,
+    };
+    return smq_create_ex(&config);
+}
+
+/**
+ * Create Simple Request Queue from configuration.
+ *
+ * - Apply environment overrides and validate tunables.
+ * - Initialize values.
+ * - Create internal queues (and attach the named queue plus any others).
+ * - Create pusher and puller threads (with configured attributes).
+ * - Restore pending messages from snapshot (if configured).
+ *
+ * @param   config      Configuration (zero fields select defaults).
+ * @return  Newly allocated Simple Request Queue structure (NULL if invalid).
+ **/
+SMQ * smq_create_ex(const SMQConfig *config) {
+    if (!config) return NULL;
+
+    SMQConfig settings = *config;
+    if (!smq_configure(&settings)) return NULL;
+
+    const char *name = settings.name;
+    const char *host = settings.host;
+    const char *port = settings.port;
     SMQ *smq = calloc(1, sizeof(*smq));
 
     if (smq) {
         if (!name) name = "";
-        strncpy(smq->name, name, sizeof smq->name - 1);
-        smq->name[sizeof smq->name - 1] = '\0';
-
         if (!host) host = "localhost";
-        if (!port) port = "9620";
-        snprintf(smq->server_url, sizeof smq->server_url, "http://%s:%s", host, port);
+        if (!port) port = SMQ_PORT;
+
+        smq->name      = strdup(name);
+        smq->endpoints = endpoints_create(host, port, settings.failures, settings.cooldown);
+        if (smq->endpoints) {
+            smq->acks  = calloc(smq->endpoints->count, sizeof(Settlements));
+            smq->nacks = calloc(smq->endpoints->count, sizeof(Settlements));
+            smq->partitioned = settings.partition && endpoints_partition(smq->endpoints, settings.vnodes);
+        }
+
+        smq->timeout         = settings.timeout;
+        smq->connect_timeout = settings.connect_timeout;
+        smq->running         = true;
+        smq->lease           = SMQ_LEASE;
+        smq->batch           = settings.batch;
+        smq->retries         = settings.retries;
+        smq->backoff         = settings.backoff;
+        smq->ttl             = settings.ttl;
+        smq->npushers        = settings.pushers;
+        smq->npullers        = settings.pullers;
 
-        smq->timeout = 2000;
-        smq->running = true;
+        mutex_init(&smq->lock, NULL);
+        cond_init(&smq->window, NULL);
+        cond_init(&smq->stopped, NULL);
 
         smq->outgoing = queue_create();
         smq->incoming = queue_create();
-        if (!smq->outgoing || !smq->incoming) { 
-            free(smq); return NULL; 
+        smq->scheduled = wheel_create();
+        smq->pushers  = calloc(smq->npushers, sizeof(Thread));
+        smq->pullers  = calloc(smq->npullers, sizeof(Thread));
+        if (!smq->name || !smq->endpoints || !smq->acks || !smq->nacks ||
+            !smq->outgoing || !smq->incoming || !smq->scheduled || !smq->pushers || !smq->pullers ||
+            !smq_lanes(smq) ||
+            !smq_attach(smq, smq->name, 1, true) || !smq_attach_list(smq, settings.queues)) {
+            smq->running = false;
+            smq->npushers = smq->npullers = 0;
+            smq_delete(smq);
+            return NULL;
+        }
+
+        if (settings.capacity) {
+            for (size_t i = 1; i < smq->nlanes; i++) {
+                queue_capacity(smq->lanes[i], settings.capacity);
+            }
+            queue_capacity(smq->outgoing, settings.capacity);
+            queue_capacity(smq->incoming, settings.capacity);
+        }
+        if (settings.max_bytes) {
+            smq_limit(smq, settings.max_bytes);
+        }
+        if (settings.rate) {
+            smq_throttle(smq, NULL, settings.rate, settings.burst, false);
         }
+        queue_expire(smq->incoming, smq_discard, smq);
 
-        thread_create(&smq->pusher, NULL, smq_pusher, smq);
-        thread_create(&smq->puller, NULL, smq_puller, smq);
+        for (size_t i = 0; i < smq->npushers; i++) {
+            smq_thread_start(&smq->pushers[i], &settings.pusher, "smq-pusher", i, smq->npushers, smq_pusher, smq);
+        }
+        // Restored messages go back in line before the pullers fetch new ones
+        // (outgoing ones may have to wait for the pushers to make room)
+        if (settings.snapshot) {
+            smq_restore(smq, settings.snapshot);
+        }
+        for (size_t i = 0; i < smq->npullers; i++) {
+            smq_thread_start(&smq->pullers[i], &settings.puller, "smq-puller", i, smq->npullers, smq_puller, smq);
+        }
 
         return smq;
     }
@@ -62,8 +181,52 @@ SMQ * smq_create(const char *name, const char *host, const char *port) {
 void smq_delete(SMQ *smq) {
     if (!smq) return;
     if (smq->running) smq_shutdown(smq);
+    while (smq->queues) {
+        SMQQueue *next = smq->queues->next;
+        if (smq->queues->incoming != smq->incoming) queue_delete(smq->queues->incoming);
+        free(smq->queues->name);
+        free(smq->queues);
+        smq->queues = next;
+    }
+    for (size_t i = 1; i < smq->nlanes; i++) {
+        queue_delete(smq->lanes[i]);
+    }
+    free(smq->lanes);
     if (smq->outgoing) queue_delete(smq->outgoing);
     if (smq->incoming) queue_delete(smq->incoming);
+    if (smq->scheduled) wheel_delete(smq->scheduled);
+
+    free(smq->pushers);
+    free(smq->pullers);
+    free(smq->name);
+
+    while (smq->throttles) {
+        Throttle *next = smq->throttles->next;
+        free(smq->throttles->topic);
+        free(smq->throttles);
+        smq->throttles = next;
+    }
+    while (smq->unsent) {
+        Request *next = smq->unsent->next;
+        request_delete(smq->unsent);
+        smq->unsent = next;
+    }
+    while (smq->deliveries) {
+        Delivery *next = smq->deliveries->next;
+        free(smq->deliveries);
+        smq->deliveries = next;
+    }
+    for (size_t i = 0; smq->endpoints && i < smq->endpoints->count; i++) {
+        if (smq->acks)  free(smq->acks[i].ids);
+        if (smq->nacks) free(smq->nacks[i].ids);
+    }
+    free(smq->acks);
+    free(smq->nacks);
+    endpoints_delete(smq->endpoints);
+
+    mutex_destroy(&smq->lock);
+    cond_destroy(&smq->window);
+    cond_destroy(&smq->stopped);
     free(smq);
 }
 
@@ -74,18 +237,135 @@ void smq_delete(SMQ *smq) {
  * @param   body    Request body to publish.
  **/
 void smq_publish(SMQ *smq, const char *topic, const char *body) {
-    if (!smq || !topic || !smq->running) return;
+    smq_publish_until(smq, topic, body, DEADLINE_NEVER);
+}
 
-    const char *method = "PUT";
-    char url[1024];
-    snprintf(url, sizeof(url), "%s/topic/%s", smq->server_url, topic);
+/**
+ * Publish one message to topic that expires after ttl milliseconds.
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Request body to publish.
+ * @param   ttl     Time to live in milliseconds.
+ * @return  Whether or not message was queued before it expired.
+ **/
+bool smq_publish_ttl(SMQ *smq, const char *topic, const char *body, time_t ttl) {
+    return smq_publish_until(smq, topic, body, deadline_after(ttl));
+}
 
-    if (!body) body = "";
+/**
+ * Publish one message to topic at (or just after) a later time.
+ *
+ * The message waits in the client's timer wheel, which takes O(1) to add to
+ * and to expire from no matter how many messages are scheduled, and a single
+ * timer thread (started on first use) moves it to the outgoing queue once
+ * due.  The client's TTL (if any) counts from then.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Request body to publish.
+ * @param   due     When to publish message (ie. deadline_after(30000)).
+ * @return  Whether or not message was scheduled (false if too many are).
+ **/
+bool smq_publish_at(SMQ *smq, const char *topic, const char *body, Deadline due) {
+    if (!smq || !topic || !smq->running) return false;
+
+    Request *request = smq_message(smq, topic, body);
+    if (!request) return false;
+
+    request->deadline = 0;
+    if (!smq_schedule(smq, request, due)) {
+        request_delete(request);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Schedule Request to be moved to the outgoing queue at specified time.
+ * @param   smq         Simple Request Queue structure.
+ * @param   request     Request structure.
+ * @param   due         When Request comes due.
+ * @return  Whether or not SMQ took ownership of Request.
+ **/
+bool smq_schedule(SMQ *smq, Request *request, Deadline due) {
+    return smq_timer_start(smq) && wheel_add(smq->scheduled, request, due);
+}
+
+/**
+ * Return outgoing queue Request must wait in.
+ *
+ * A partitioned client gives each pusher its own lane, and Requests go to
+ * the lane of their topic's home broker, so that messages of one topic are
+ * always sent by the same pusher and thus in order.
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   request     Request structure (url set to /topic/$topic).
+ * @return  Queue structure.
+ **/
+Queue * smq_outgoing(SMQ *smq, const Request *request) {
+    if (!smq->lanes || !request->url) return smq->outgoing;
+    return smq->lanes[endpoints_home(smq->endpoints, request->url) % smq->nlanes];
+}
+
+/**
+ * Publish one message to topic, giving up if it cannot be sent by deadline.
+ *
+ * The deadline covers the whole trip: waiting for room in the outgoing
+ * queue, waiting for the pusher, retries and their backoff, and the request
+ * to the broker itself.  It then travels with the message as its time to
+ * live, so the broker and the subscriber's client drop the message too once
+ * the deadline passes, instead of delivering it late.
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Request body to publish.
+ * @param   deadline    When message stops being worth sending (ie. deadline_after(ms)).
+ * @return  Whether or not message was queued before deadline.
+ **/
+bool smq_publish_until(SMQ *smq, const char *topic, const char *body, Deadline deadline) {
+    if (!smq || !topic || !smq->running) return false;
+
+    Request *request = smq_message(smq, topic, body);
+    if (!request) return false;
+
+    // The client's default TTL (set by smq_message) still applies if sooner
+    if (!request->deadline || deadline < request->deadline) {
+        request->deadline = deadline != DEADLINE_NEVER ? deadline : 0;
+    }
+
+    if (!queue_push_until(smq_outgoing(smq, request), request, request->deadline ? request->deadline : deadline)) {
+        request_delete(request);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Publish newest value of key to topic, replacing any unsent value of key.
+ *
+ * This is meant for state topics (ie. prices or health) where only the latest
+ * update matters: while the broker is slow, at most one message per topic and
+ * key waits in the outgoing queue, and it keeps its original place in line.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   key     Key identifying value within topic.
+ * @param   body    Request body to publish.
+ **/
+void smq_publish_conflated(SMQ *smq, const char *topic, const char *key, const char *body) {
+    if (!smq || !topic || !key || !smq->running) return;
 
-    Request *request = request_create(method, url, body);
+    Request *request = smq_message(smq, topic, body);
     if (!request) return;
 
-    queue_push(smq->outgoing, request);
+    if (!(request->key = strdup(key))) {
+        request_delete(request);
+        return;
+    }
+
+    if (!queue_push(smq_outgoing(smq, request), request)) {
+        request_delete(request);
+    }
 }
 
 /**
@@ -97,60 +377,199 @@ void smq_publish(SMQ *smq, const char *topic, const char *body) {
  * @return  Newly allocated message body (must be freed).
  **/
 char * smq_retrieve(SMQ *smq) {
+    return smq ? smq_retrieve_until(smq, deadline_after(smq->timeout)) : NULL;
+}
+
+/**
+ * Retrieve one message, waiting at most until deadline for one to arrive.
+ * @param   smq         Simple Request Queue structure.
+ * @param   deadline    When to give up waiting.
+ * @return  Newly allocated message body (must be freed, NULL on timeout).
+ **/
+char * smq_retrieve_until(SMQ *smq, Deadline deadline) {
     if (!smq) return NULL;
     if (!smq->running) return NULL;
 
-    Request *r = queue_pop(smq->incoming, smq->timeout);
+    return smq_take(smq, smq->incoming, deadline);
+}
+
+/**
+ * Retrieve one message fetched from an attached queue that is not merged.
+ *
+ * Messages of merged queues (including the client's own) are retrieved with
+ * smq_retrieve instead, and so are those of queue if it is merged.
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   queue       Name of attached queue.
+ * @param   deadline    When to give up waiting.
+ * @return  Newly allocated message body (must be freed, NULL on timeout or
+ *          if queue is not attached).
+ **/
+char * smq_retrieve_from(SMQ *smq, const char *queue, Deadline deadline) {
+    if (!smq || !queue || !smq->running) return NULL;
+
+    Queue *incoming = NULL;
+    mutex_lock(&smq->lock);
+    for (SMQQueue *q = smq->queues; q && !incoming; q = q->next) {
+        if (streq(q->name, queue)) incoming = q->incoming;
+    }
+    mutex_unlock(&smq->lock);
+
+    return incoming ? smq_take(smq, incoming, deadline) : NULL;
+}
+
+/**
+ * Take one message from incoming queue (remembering it if it is leased).
+ * @param   smq         Simple Request Queue structure.
+ * @param   incoming    Incoming queue to take message from.
+ * @param   deadline    When to give up waiting.
+ * @return  Newly allocated message body (must be freed, NULL on timeout).
+ **/
+static char * smq_take(SMQ *smq, Queue *incoming, Deadline deadline) {
+    Request *r = queue_pop_until(incoming, deadline);
     if (!r) return NULL;
 
+    if (r->trace) {
+        trace_stamp(r->trace, TRACE_RETRIEVE);
+        tracer_record(&smq->tracer, r->trace, TRACE_RETRIEVE);
+    }
+
     char *message = NULL;
     if (r->body) {
         message = r->body;      /* hand ownership to caller */
         r->body = NULL;
     }
 
+    // Remember leased messages so smq_ack can find their broker ids
+    if (message && r->id) {
+        Delivery *delivery = calloc(1, sizeof(Delivery));
+        if (delivery) {
+            delivery->message  = message;
+            delivery->id       = r->id;
+            delivery->expires  = deadline_after(smq->lease);
+            delivery->endpoint = r->endpoint;
+            mutex_lock(&smq->lock);
+            delivery->next  = smq->deliveries;
+            smq->deliveries = delivery;
+            mutex_unlock(&smq->lock);
+        }
+    }
+
     request_delete(r);
     return message;
 }
 
 /**
  * Subscribe to specified topic.
+ *
+ * Topics are words separated by '.', and topic may be a pattern where '*'
+ * matches exactly one word and '#' matches zero or more words (ie.
+ * metrics.*.cpu or metrics.#).
+ *
  * @param   smq     Simple Request Queue structure.
- * @param   topic   Topic string to subscribe to.
+ * @param   topic   Topic string (or pattern) to subscribe to.
  **/
 void smq_subscribe(SMQ *smq, const char *topic) {
-    if (!smq || !topic || !smq->running) return;
+    if (!smq) return;
+    smq_subscription(smq, "PUT", smq->name, topic);
+}
 
-    char url[1024];
-    snprintf(url, sizeof url, "%s/subscription/%s/%s", smq->server_url, smq->name, topic);
+/**
+ * Unsubscribe to specified topic.
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic string (or pattern) to unsubscribe from.
+ **/
+void smq_unsubscribe(SMQ *smq, const char *topic) {
+    if (!smq) return;
+    smq_subscription(smq, "DELETE", smq->name, topic);
+}
 
-    Request *request = request_create("PUT", url, "");
-    if (!request) return;
+/**
+ * Subscribe another broker queue (ie. one attached with smq_attach) to topic.
+ * @param   smq     Simple Request Queue structure.
+ * @param   queue   Name of broker queue.
+ * @param   topic   Topic string (or pattern) to subscribe to.
+ **/
+void smq_subscribe_queue(SMQ *smq, const char *queue, const char *topic) {
+    smq_subscription(smq, "PUT", queue, topic);
+}
 
-    // Perform request directly and synchronously
-    char *response = request_perform(request, smq->timeout);
-    free(response);
-    request_delete(request);
+/**
+ * Unsubscribe another broker queue from topic.
+ * @param   smq     Simple Request Queue structure.
+ * @param   queue   Name of broker queue.
+ * @param   topic   Topic string (or pattern) to unsubscribe from.
+ **/
+void smq_unsubscribe_queue(SMQ *smq, const char *queue, const char *topic) {
+    smq_subscription(smq, "DELETE", queue, topic);
 }
 
 /**
- * Unsubscribe to specified topic.
+ * Attach client to another broker queue (or reweigh one already attached).
+ *
+ * Pullers take turns fetching from every attached queue by smooth weighted
+ * round-robin, so a queue of weight 3 gets three fetches for each one of a
+ * queue of weight 1 while both have messages, and idle queues cost their
+ * busy neighbours only a quick poll.  One client (with one puller per
+ * broker) thus consumes any number of queues.
+ *
+ * Messages of merged queues are retrieved with smq_retrieve along with the
+ * client's own.  Otherwise the queue gets an incoming queue of its own (with
+ * the same capacity and limits), retrieved with smq_retrieve_from, so that a
+ * backlog in one queue never holds up the application's others.
+ *
  * @param   smq     Simple Request Queue structure.
- * @param   topic   Topic string to unsubscribe from.
+ * @param   queue   Name of broker queue.
+ * @param   weight  Share of fetches (0 for 1).
+ * @param   merged  Whether to deliver into the client's incoming queue.
+ * @return  Whether or not queue is attached.
  **/
-void smq_unsubscribe(SMQ *smq, const char *topic) {
-    if (!smq || !topic || !smq->running) return;
+bool smq_attach(SMQ *smq, const char *queue, size_t weight, bool merged) {
+    if (!smq || !queue) return false;
 
-    char url[1024];
-    snprintf(url, sizeof url, "%s/subscription/%s/%s", smq->server_url, smq->name, topic);
+    SMQQueue *q = calloc(1, sizeof(SMQQueue));
+    if (!q || !(q->name = strdup(queue)) || !(q->incoming = merged ? smq->incoming : queue_create())) {
+        if (q) free(q->name);
+        free(q);
+        return false;
+    }
+    q->weight = weight ? weight : 1;
 
-    Request *request = request_create("DELETE", url, "");
-    if (!request) return;
+    if (q->incoming != smq->incoming) {
+        mutex_lock(&smq->incoming->lock);
+        size_t capacity  = smq->incoming->capacity;
+        size_t max_bytes = smq->incoming->max_bytes;
+        size_t high      = smq->incoming->high;
+        size_t low       = smq->incoming->low;
+        mutex_unlock(&smq->incoming->lock);
 
-    // Perform request directly and synchronously
-    char *response = request_perform(request, smq->timeout);
-    free(response);
-    request_delete(request);
+        queue_capacity(q->incoming, capacity);
+        queue_limit(q->incoming, max_bytes, high, low);
+        queue_expire(q->incoming, smq_discard, smq);
+    }
+
+    // Appended, so queues take their turns in the order they were attached
+    mutex_lock(&smq->lock);
+    SMQQueue **tail = &smq->queues;
+    while (*tail && !streq((*tail)->name, queue)) {
+        tail = &(*tail)->next;
+    }
+    if (*tail) {
+        (*tail)->weight = q->weight;
+    } else {
+        if (!smq->running && q->incoming != smq->incoming) queue_shutdown(q->incoming);
+        *tail = q;
+        q     = NULL;
+        smq->nqueues++;
+    }
+    mutex_unlock(&smq->lock);
+
+    if (q) {                    // Already attached
+        if (q->incoming != smq->incoming) queue_delete(q->incoming);
+        free(q->name);
+        free(q);
+    }
+    return true;
 }
 
 /**
@@ -167,11 +586,38 @@ void smq_shutdown(SMQ *smq) {
 
     smq->running = false;
 
+    mutex_lock(&smq->lock);
+    cond_broadcast(&smq->window);
+    cond_broadcast(&smq->stopped);
+    mutex_unlock(&smq->lock);
+
+    for (size_t i = 1; i < smq->nlanes; i++) {
+        queue_shutdown(smq->lanes[i]);
+    }
     if (smq->outgoing) queue_shutdown(smq->outgoing);
     if (smq->incoming) queue_shutdown(smq->incoming);
+    if (smq->scheduled) wheel_shutdown(smq->scheduled);
 
-    thread_join(smq->pusher, NULL);
-    thread_join(smq->puller, NULL);
+    mutex_lock(&smq->lock);
+    for (SMQQueue *q = smq->queues; q; q = q->next) {
+        if (q->incoming != smq->incoming) queue_shutdown(q->incoming);
+    }
+    mutex_unlock(&smq->lock);
+
+    for (size_t i = 0; i < smq->npushers; i++) {
+        thread_join(smq->pushers[i], NULL);
+    }
+    for (size_t i = 0; i < smq->npullers; i++) {
+        thread_join(smq->pullers[i], NULL);
+    }
+
+    mutex_lock(&smq->lock);
+    bool timing = smq->timing;
+    smq->timing = false;
+    mutex_unlock(&smq->lock);
+    if (timing) {
+        thread_join(smq->timer, NULL);
+    }
 }
 
 /**
@@ -182,22 +628,962 @@ bool smq_running(SMQ *smq) {
     return smq && smq->running;
 }
 
+/**
+ * Enable at-least-once delivery with a prefetch window.
+ *
+ * Messages are leased from the broker rather than removed, and the puller
+ * stops fetching once window messages are unacknowledged.  Each message
+ * returned by smq_retrieve must then be passed to smq_ack (or smq_nack)
+ * before it is freed, otherwise the broker redelivers it after lease expires.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   window  Maximum unacknowledged messages (0 disables leases).
+ * @param   lease   Time broker waits for acknowledgement (milliseconds).
+ **/
+void smq_prefetch(SMQ *smq, size_t window, time_t lease) {
+    if (!smq) return;
+
+    mutex_lock(&smq->lock);
+    smq->prefetch = window;
+    smq->lease    = lease > 0 ? lease : smq->lease;
+    cond_broadcast(&smq->window);
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Limit how many messages the puller fetches ahead of the application.
+ *
+ * The puller only requests a message from the broker once incoming has a
+ * free slot for it, so messages beyond credits stay queued on the broker.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   credits Maximum messages waiting in incoming queue.
+ **/
+void smq_credit(SMQ *smq, size_t credits) {
+    if (!smq) return;
+
+    queue_capacity(smq->incoming, credits);
+
+    mutex_lock(&smq->lock);
+    for (SMQQueue *q = smq->queues; q; q = q->next) {
+        if (q->incoming != smq->incoming) queue_capacity(q->incoming, credits);
+    }
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Limit the message bytes buffered in each of the internal queues.
+ *
+ * Once a queue holds 3/4 of bytes, smq_publish blocks (for outgoing) or the
+ * puller stops fetching (for incoming) until the queue drains to 1/2 of bytes.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   bytes   Maximum message bytes per queue (0 for unlimited).
+ **/
+void smq_limit(SMQ *smq, size_t bytes) {
+    if (!smq) return;
+
+    for (size_t i = 1; i < smq->nlanes; i++) {
+        queue_limit(smq->lanes[i], bytes, bytes / 4 * 3, bytes / 2);
+    }
+    queue_limit(smq->outgoing, bytes, bytes / 4 * 3, bytes / 2);
+    queue_limit(smq->incoming, bytes, bytes / 4 * 3, bytes / 2);
+
+    mutex_lock(&smq->lock);
+    for (SMQQueue *q = smq->queues; q; q = q->next) {
+        if (q->incoming != smq->incoming) queue_limit(q->incoming, bytes, bytes / 4 * 3, bytes / 2);
+    }
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Limit the rate at which messages are published (to topics matching topic).
+ *
+ * Pushers take a token from every matching limit before sending a message,
+ * so a topic limit and the client's own limit both apply.  Over the limit,
+ * a message is either held back on the timer wheel until its token is due
+ * (while the pusher goes on with other topics), or dropped.  Each pattern gets one bucket, so that topics matching
+ * tenant.# share their tenant's rate.  Calling this again for the same
+ * pattern changes its rate in place.
+ *
+ * Taking a token is a single compare and swap, so the pushers never contend
+ * for a lock over it; limits are only ever added, never freed, while the
+ * client runs.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic pattern to limit (* and # wildcards, NULL for every topic).
+ * @param   rate    Messages per second (0 for unlimited).
+ * @param   burst   Messages that may be sent at once within rate (0 for 1).
+ * @param   reject  Whether to drop messages over the limit (or delay them).
+ * @return  Whether or not limit was set.
+ **/
+bool smq_throttle(SMQ *smq, const char *topic, double rate, size_t burst, bool reject) {
+    if (!smq || rate < 0) return false;
+
+    mutex_lock(&smq->lock);
+    Throttle *throttle = smq->throttles;
+    while (throttle && !(topic ? throttle->topic && streq(throttle->topic, topic) : !throttle->topic)) {
+        throttle = throttle->next;
+    }
+
+    if (!throttle) {
+        throttle = calloc(1, sizeof(Throttle));
+        if (!throttle || (topic && !(throttle->topic = strdup(topic)))) {
+            mutex_unlock(&smq->lock);
+            free(throttle);
+            return false;
+        }
+        bucket_init(&throttle->bucket, rate, burst);
+        throttle->reject = reject;
+        throttle->next   = smq->throttles;
+        __atomic_store_n(&smq->throttles, throttle, __ATOMIC_RELEASE);
+    } else {
+        bucket_init(&throttle->bucket, rate, burst);
+        __atomic_store_n(&throttle->reject, reject, __ATOMIC_RELAXED);
+    }
+    mutex_unlock(&smq->lock);
+    return true;
+}
+
+/**
+ * Acknowledge message so the broker discards it (sent in batches by pusher).
+ * @param   smq     Simple Request Queue structure.
+ * @param   message Message body returned by smq_retrieve (before it is freed).
+ **/
+void smq_ack(SMQ *smq, const char *message) {
+    smq_settle(smq, message, true);
+}
+
+/**
+ * Reject message so the broker redelivers it immediately.
+ * @param   smq     Simple Request Queue structure.
+ * @param   message Message body returned by smq_retrieve (before it is freed).
+ **/
+void smq_nack(SMQ *smq, const char *message) {
+    smq_settle(smq, message, false);
+}
+
+/**
+ * Trace 1 in rate published messages (0 disables tracing).
+ *
+ * Traced messages carry their stamps through the broker, so the consumer
+ * records broker and delivery latencies for messages the publisher sampled.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   rate    Sampling rate.
+ **/
+void smq_trace(SMQ *smq, size_t rate) {
+    if (smq) {
+        __atomic_store_n(&smq->tracer.rate, rate, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Return latency histogram for stage (time since the previous known stage).
+ * @param   smq     Simple Request Queue structure.
+ * @param   stage   Stage to return histogram for.
+ * @return  Histogram structure (NULL if invalid).
+ **/
+const Histogram * smq_latency(SMQ *smq, TraceStage stage) {
+    if (!smq || stage >= TRACE_STAGES) return NULL;
+    return &smq->tracer.stages[stage];
+}
+
 /* Internal Functions */
 
+/**
+ * Create PUT Request that publishes body to topic (sampled for tracing).
+ * @param   smq     Simple Request Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Request body to publish.
+ * @return  Newly allocated Request structure.
+ **/
+static Request * smq_message(SMQ *smq, const char *topic, const char *body) {
+    const char *method = "PUT";
+    char  escaped[3*strlen(topic) + 1];
+    char *url = smq_url("/topic/%s",
+        transport_escape(escaped, sizeof(escaped), topic));
+
+    if (!body) body = "";
+
+    Request *request = url ? request_create(method, NULL, body) : NULL;
+    if (!request) {
+        free(url);
+        return NULL;
+    }
+    request->url = url;
+
+    if (tracer_sample(&smq->tracer)) {
+        request->trace = trace_create();
+        trace_stamp(request->trace, TRACE_PUBLISH);
+    }
+
+    if (smq->ttl) {
+        request->deadline = deadline_after(smq->ttl);
+    }
+
+    return request;
+}
+
+/**
+ * Subscribe (PUT) or unsubscribe (DELETE) broker queue to or from topic.
+ * @param   smq     Simple Request Queue structure.
+ * @param   method  Request method string.
+ * @param   queue   Name of broker queue.
+ * @param   topic   Topic string (or pattern).
+ **/
+static void smq_subscription(SMQ *smq, const char *method, const char *queue, const char *topic) {
+    if (!smq || !queue || !topic || !smq->running) return;
+
+    char  escaped[3*strlen(topic) + 1];
+    char *url = smq_url("/subscription/%s/%s", queue,
+        transport_escape(escaped, sizeof(escaped), topic));
+
+    Request *request = url ? request_create(method, NULL, "") : NULL;
+    if (!request) {
+        free(url);
+        return;
+    }
+    request->url = url;
+
+    // Perform request directly and synchronously on every broker, so that
+    // whichever one publishers fail over to has the subscription
+    for (size_t i = 0; i < smq->endpoints->count; i++) {
+        request->endpoint = i + 1;
+        free(smq_send(smq, request, NULL, false, 0));
+    }
+    request_delete(request);
+}
+
+/**
+ * Create outgoing lane of each pusher (when partitioned with several).
+ * @param   smq     Simple Request Queue structure.
+ * @return  Whether or not lanes were created (or are not needed).
+ **/
+static bool smq_lanes(SMQ *smq) {
+    if (!smq->partitioned || smq->npushers < 2) return true;
+
+    if (!(smq->lanes = calloc(smq->npushers, sizeof(Queue *)))) return false;
+
+    smq->lanes[0] = smq->outgoing;
+    for (smq->nlanes = 1; smq->nlanes < smq->npushers; smq->nlanes++) {
+        if (!(smq->lanes[smq->nlanes] = queue_create())) return false;
+    }
+    return true;
+}
+
+/**
+ * Attach (merged) every queue in comma separated list of name[:weight].
+ * @param   smq     Simple Request Queue structure.
+ * @param   list    List of queues (NULL for none).
+ * @return  Whether or not every queue was attached.
+ **/
+static bool smq_attach_list(SMQ *smq, const char *list) {
+    for (const char *s = list ? list : ""; *s; ) {
+        size_t length = strcspn(s, ",");
+        if (length) {
+            char name[length + 1];
+            memcpy(name, s, length);
+            name[length] = 0;
+
+            char  *separator = strchr(name, ':');
+            size_t weight    = 1;
+            if (separator) {
+                char *end;
+                *separator = 0;
+                weight = strtoul(separator + 1, &end, 10);
+                if (*end || end == separator + 1) {
+                    error("Invalid weight of queue %s: %s", name, separator + 1);
+                    return false;
+                }
+            }
+            if (!*name || !smq_attach(smq, name, weight, true)) return false;
+        }
+
+        s += length;
+        if (*s == ',') s++;
+    }
+    return true;
+}
+
+/**
+ * Pick queue for next fetch by smooth weighted round-robin (SMQ lock must be
+ * held).
+ *
+ * Every queue earns its weight in credit each turn, and the richest one is
+ * picked and pays back the total, so turns are spread out (ie. a a b a for
+ * weights 3 and 1) rather than bunched.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @return  Queue to fetch from.
+ **/
+static SMQQueue * smq_rotate(SMQ *smq) {
+    SMQQueue *picked = NULL;
+    long      total  = 0;
+
+    for (SMQQueue *q = smq->queues; q; q = q->next) {
+        q->current += q->weight;
+        total      += q->weight;
+        if (!picked || q->current > picked->current) picked = q;
+    }
+
+    picked->current -= total;
+    return picked;
+}
+
+/**
+ * Record acknowledgement (or rejection) of retrieved message.
+ *
+ * The first settlement of a batch queues a flush Request in the outgoing
+ * queue; every settlement recorded before the pusher reaches it is sent in
+ * the same request.  Settlements are kept per broker, since only the broker
+ * that leased a message can settle it.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   message Message body returned by smq_retrieve.
+ * @param   ack     Whether to acknowledge (true) or reject (false) message.
+ **/
+static void smq_settle(SMQ *smq, const char *message, bool ack) {
+    if (!smq || !message) return;
+
+    Settlements *batch    = NULL;
+    size_t       endpoint = 0;
+    bool         flush    = false;
+
+    mutex_lock(&smq->lock);
+    for (Delivery **d = &smq->deliveries; *d; d = &(*d)->next) {
+        if ((*d)->message != message) continue;
+
+        Delivery *delivery = *d;
+        *d = delivery->next;
+
+        endpoint = delivery->endpoint ? delivery->endpoint : 1;
+        batch    = ack ? &smq->acks[endpoint - 1] : &smq->nacks[endpoint - 1];
+
+        char id[32];
+        int  length = snprintf(id, sizeof(id), "%lu\n", delivery->id);
+        char *ids   = realloc(batch->ids, batch->length + length + 1);
+        if (ids) {
+            memcpy(ids + batch->length, id, length + 1);
+            batch->ids     = ids;
+            batch->length += length;
+            batch->count++;
+
+            // Queue one flush Request per batch of ids
+            if (batch->count > batch->requests * smq->batch) {
+                batch->requests++;
+                flush = true;
+            }
+        }
+
+        if (smq->unacked) smq->unacked--;
+        cond_signal(&smq->window);
+        free(delivery);
+        break;
+    }
+    mutex_unlock(&smq->lock);
+
+    if (flush) {
+        Request *request = request_create(ack ? "ACK" : "NACK", NULL, NULL);
+        if (request && !(request->url = smq_url("/%s/%s", ack ? "ack" : "nack", smq->name))) {
+            request_delete(request);
+            request = NULL;
+        }
+        if (request) {
+            request->endpoint = endpoint;
+        }
+        if (!queue_push(smq->outgoing, request)) {
+            request_delete(request);
+        }
+    }
+}
+
+/**
+ * Forget deliveries whose leases expired (SMQ lock must be held).
+ *
+ * The broker has already requeued these messages, so they no longer count
+ * against the prefetch window.
+ *
+ * @param   smq     Simple Request Queue structure.
+ **/
+static void smq_expire(SMQ *smq) {
+    Deadline now = deadline_after(0);
+
+    for (Delivery **d = &smq->deliveries; *d; ) {
+        if ((*d)->expires > now) {
+            d = &(*d)->next;
+            continue;
+        }
+
+        Delivery *delivery = *d;
+        *d = delivery->next;
+        free(delivery);
+        if (smq->unacked) smq->unacked--;
+    }
+}
+
+/**
+ * Drop incoming message that expired before the application retrieved it.
+ *
+ * A leased message no longer counts against the prefetch window; its lease
+ * simply runs out, and the broker drops it then since it has expired.
+ *
+ * @param   request     Expired message Request.
+ * @param   arg         Simple Request Queue structure.
+ **/
+static void smq_discard(Request *request, void *arg) {
+    SMQ *smq = arg;
+
+    if (request->id) {
+        mutex_lock(&smq->lock);
+        if (smq->unacked) smq->unacked--;
+        cond_signal(&smq->window);
+        mutex_unlock(&smq->lock);
+    }
+
+    request_delete(request);
+}
+
+/**
+ * Keep Request that was interrupted by shutdown, so smq_snapshot can save it.
+ *
+ * Requests are appended, so the list stays oldest first (it holds at most
+ * one Request per pusher, plus any the timer could not queue).
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   request     Unsent Request.
+ **/
+static void smq_unsent(SMQ *smq, Request *request) {
+    mutex_lock(&smq->lock);
+    Request **tail = &smq->unsent;
+    while (*tail) tail = &(*tail)->next;
+    request->next = NULL;
+    *tail         = request;
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Start timer thread (unless it is already running).
+ * @param   smq     Simple Request Queue structure.
+ * @return  Whether or not timer thread is running.
+ **/
+static bool smq_timer_start(SMQ *smq) {
+    static const SMQThreadConfig defaults = {0};
+
+    mutex_lock(&smq->lock);
+    if (!smq->timing && smq->running) {
+        smq_thread_start(&smq->timer, &defaults, "smq-timer", 0, 1, smq_timer, smq);
+        smq->timing = true;
+    }
+    bool timing = smq->timing;
+    mutex_unlock(&smq->lock);
+    return timing;
+}
+
+/**
+ * Apply rate limits to published message before pusher sends it.
+ *
+ * Limits that reject are checked first, and if one of them has no token,
+ * the tokens already taken from the others are put back and the message is
+ * dropped.  Limits that delay then each reserve a token, and a message whose
+ * token is not due yet is deferred on the timer wheel until it is (or until
+ * its deadline, which smq_send then notices), so the pusher moves on to the
+ * messages of other topics instead of waiting with it.
+ *
+ * @param   smq         Simple Request Queue structure.
+ * @param   request     Request about to be sent.
+ * @return  Whether to send Request now (otherwise it was dropped or
+ *          deferred, and no longer belongs to the caller).
+ **/
+static bool smq_throttled(SMQ *smq, Request *request) {
+    Throttle *throttles = __atomic_load_n(&smq->throttles, __ATOMIC_ACQUIRE);
+    if (!throttles || request->throttled || !streq(request->method, "PUT") || strncmp(request->url, "/topic/", 7)) {
+        return true;
+    }
+
+    char topic[strlen(request->url) + 1];
+    transport_unescape(strcpy(topic, request->url + 7));
+
+    uint64_t now = deadline_after(0);
+    for (Throttle *throttle = throttles; throttle; throttle = throttle->next) {
+        if (!__atomic_load_n(&throttle->reject, __ATOMIC_RELAXED)) continue;
+        if (throttle->topic && !transport_match(throttle->topic, topic)) continue;
+        if (!bucket_take(&throttle->bucket, now, false)) continue;
+
+        for (Throttle *taken = throttles; taken != throttle; taken = taken->next) {
+            if (!__atomic_load_n(&taken->reject, __ATOMIC_RELAXED)) continue;
+            if (taken->topic && !transport_match(taken->topic, topic)) continue;
+            bucket_refund(&taken->bucket);
+        }
+        __atomic_add_fetch(&throttle->rejected, 1, __ATOMIC_RELAXED);
+        request_delete(request);
+        return false;
+    }
+
+    Deadline wait = 0;
+    for (Throttle *throttle = throttles; throttle; throttle = throttle->next) {
+        if (__atomic_load_n(&throttle->reject, __ATOMIC_RELAXED)) continue;
+        if (throttle->topic && !transport_match(throttle->topic, topic)) continue;
+
+        uint64_t until = bucket_take(&throttle->bucket, now, true);
+        if (until) {
+            __atomic_add_fetch(&throttle->delayed, 1, __ATOMIC_RELAXED);
+            if (until > wait) wait = until;
+        }
+    }
+    if (!wait) return true;
+
+    if (request->deadline && request->deadline < wait) wait = request->deadline;
+    request->throttled = true;
+    if (smq_schedule(smq, request, wait)) return false;
+    if (!smq_running(smq)) {
+        smq_unsent(smq, request);
+        return false;
+    }
+
+    // Timer wheel is full, so hold the pusher instead
+    probe_scope(PROBE_THROTTLE);
+    mutex_lock(&smq->lock);
+    while (smq_running(smq)) {
+        if (deadline_wait(&smq->stopped, &smq->lock, wait) == ETIMEDOUT) {
+            break;
+        }
+    }
+    mutex_unlock(&smq->lock);
+    return true;
+}
+
+/**
+ * Turn flush Request into a PUT carrying up to a batch of pending settlements.
+ * @param   smq     Simple Request Queue structure.
+ * @param   request ACK or NACK Request taken from outgoing queue.
+ **/
+static void smq_settlements_take(SMQ *smq, Request *request) {
+    size_t       index = request->endpoint - 1;
+    Settlements *batch = streq(request->method, "ACK") ? &smq->acks[index] : &smq->nacks[index];
+
+    mutex_lock(&smq->lock);
+    // Split off the first batch ids (the rest go with the next flush Request)
+    size_t length = 0;
+    size_t count  = 0;
+    while (length < batch->length && count < smq->batch) {
+        length += strcspn(batch->ids + length, "\n") + 1;
+        count++;
+    }
+
+    free(request->body);
+    request->body   = strndup(batch->ids ? batch->ids : "", length);
+    request->length = request->body && batch->ids ? length : 0;
+    if (request->body && batch->ids) {
+        memmove(batch->ids, batch->ids + length, batch->length - length + 1);
+        batch->length -= length;
+        batch->count  -= count;
+    }
+    if (batch->requests) batch->requests--;
+    mutex_unlock(&smq->lock);
+
+    free(request->method);
+    request->method = strdup("PUT");
+}
+
+/**
+ * Parse CPU list such as "0-3,8" (as accepted by taskset -c).
+ * @param   cpus    CPU list string (NULL or empty for none).
+ * @param   set     CPU set to fill in.
+ * @return  Whether or not CPU list is valid.
+ **/
+static bool smq_cpus(const char *cpus, cpu_set_t *set) {
+    CPU_ZERO(set);
+    if (!cpus) return true;
+
+    const char *s = cpus;
+    while (*s) {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last  = first;
+        if (end == s || first < 0) return false;
+
+        if (*end == '-') {
+            s    = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) return false;
+        }
+        if (last >= CPU_SETSIZE) return false;
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        s = end;
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Start internal thread with configured affinity, stack size, and scheduling.
+ *
+ * Note: if the attributes are refused (ie. a realtime policy without
+ * privileges), the thread is started with defaults rather than not at all.
+ *
+ * @param   thread      Thread to start.
+ * @param   config      Thread configuration.
+ * @param   name        Default thread name.
+ * @param   index       Index of thread among workers of its kind.
+ * @param   count       Number of workers of its kind.
+ * @param   function    Thread function.
+ * @param   smq         Simple Request Queue structure.
+ **/
+static void smq_thread_start(Thread *thread, const SMQThreadConfig *config, const char *name,
+                             size_t index, size_t count, void *(*function)(void *), SMQ *smq) {
+    pthread_attr_t attr;
+    cpu_set_t      cpus;
+
+    pthread_attr_init(&attr);
+    if (config->stack_size) {
+        size_t minimum = PTHREAD_STACK_MIN;     // May be a (signed) sysconf call
+        pthread_attr_setstacksize(&attr, config->stack_size < minimum ? minimum : config->stack_size);
+    }
+    if (config->cpus && smq_cpus(config->cpus, &cpus) && CPU_COUNT(&cpus)) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (config->policy) {
+        struct sched_param param = { .sched_priority = config->priority };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, config->policy);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    int rc = pthread_create(thread, &attr, function, smq);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        error("Unable to apply %s attributes: %s", name, strerror(rc));
+        thread_create(thread, NULL, function, smq);
+    }
+
+    // Linux limits names to 15 characters
+    char label[16];
+    if (count > 1) {
+        snprintf(label, sizeof(label), "%.12s.%lu", config->name ? config->name : name, index);
+    } else {
+        snprintf(label, sizeof(label), "%s", config->name ? config->name : name);
+    }
+    pthread_setname_np(*thread, label);
+}
+
+/**
+ * Read tunable from environment variable (if set).
+ * @param   variable    Name of environment variable.
+ * @param   value       Tunable to override.
+ * @return  Whether or not variable is unset or a valid non-negative number.
+ **/
+static bool smq_getenv(const char *variable, long *value) {
+    const char *s = getenv(variable);
+    if (!s || !*s) return true;
+
+    char *end;
+    long number = strtol(s, &end, 10);
+    if (*end || number < 0) {
+        error("Invalid %s: %s", variable, s);
+        return false;
+    }
+
+    *value = number;
+    return true;
+}
+
+/**
+ * Apply environment overrides and defaults to configuration and validate it.
+ *
+ * Every tunable may be overridden by the SMQ_* environment variable named in
+ * client.h, and SMQ_PUSHER_CPUS and SMQ_PULLER_CPUS override the CPU lists,
+ * so that a deployment can be tuned without rebuilding the library.  As in
+ * SMQConfig, 0 selects a default, except that SMQ_RETRIES=0 and
+ * SMQ_BACKOFF=0 turn those off (like SMQ_DISABLED).
+ *
+ * @param   config      Configuration to update.
+ * @return  Whether or not configuration is valid.
+ **/
+static bool smq_configure(SMQConfig *config) {
+    struct {
+        const char *variable;
+        void       *field;
+        bool        is_time;
+        bool        disables;   // Whether 0 in environment turns tunable off (rather than selecting default)
+    } tunables[] = {
+        {"SMQ_CAPACITY"       , &config->capacity       , false, false},
+        {"SMQ_MAX_BYTES"      , &config->max_bytes      , false, false},
+        {"SMQ_TIMEOUT"        , &config->timeout        , true , false},
+        {"SMQ_CONNECT_TIMEOUT", &config->connect_timeout, true , false},
+        {"SMQ_PUSHERS"        , &config->pushers        , false, false},
+        {"SMQ_PULLERS"        , &config->pullers        , false, false},
+        {"SMQ_BATCH"          , &config->batch          , false, false},
+        {"SMQ_RETRIES"        , &config->retries        , false, true},
+        {"SMQ_BACKOFF"        , &config->backoff        , true , true},
+        {"SMQ_FAILURES"       , &config->failures       , false, false},
+        {"SMQ_COOLDOWN"       , &config->cooldown       , true , false},
+        {"SMQ_VNODES"         , &config->vnodes         , false, false},
+        {"SMQ_TTL"            , &config->ttl            , true , false},
+        {"SMQ_RATE"           , &config->rate           , false, false},
+        {"SMQ_BURST"          , &config->burst          , false, false},
+    };
+
+    for (size_t t = 0; t < sizeof(tunables) / sizeof(tunables[0]); t++) {
+        long value = tunables[t].is_time ? *(time_t *)tunables[t].field : (long)*(size_t *)tunables[t].field;
+        if (!smq_getenv(tunables[t].variable, &value)) return false;
+
+        const char *set = getenv(tunables[t].variable);
+        if (tunables[t].disables && set && *set && !value) value = SMQ_DISABLED;
+        if (tunables[t].is_time) {
+            *(time_t *)tunables[t].field = value;
+        } else {
+            *(size_t *)tunables[t].field = value;
+        }
+    }
+
+    if (getenv("SMQ_PUSHER_CPUS")) config->pusher.cpus = getenv("SMQ_PUSHER_CPUS");
+    if (getenv("SMQ_PULLER_CPUS")) config->puller.cpus = getenv("SMQ_PULLER_CPUS");
+    if (getenv("SMQ_SNAPSHOT"))    config->snapshot    = getenv("SMQ_SNAPSHOT");
+    if (getenv("SMQ_QUEUES"))      config->queues      = getenv("SMQ_QUEUES");
+
+    long partition = config->partition;
+    if (!smq_getenv("SMQ_PARTITION", &partition)) return false;
+    config->partition = partition;
+
+    // A partitioned client talks to every broker at once, so give it one
+    // pusher and one puller per broker unless told otherwise (each pusher
+    // sends from its own lane, see smq_outgoing)
+    size_t brokers = 1;
+    for (const char *s = config->partition && config->host ? config->host : ""; *s; s++) {
+        brokers += *s == ',';
+    }
+    brokers = min(brokers, SMQ_WORKERS_MAX);
+
+    if (!config->timeout)         config->timeout = SMQ_TIMEOUT;
+    if (!config->connect_timeout) config->connect_timeout = config->timeout;
+    if (!config->pushers)         config->pushers = brokers;
+    if (!config->pullers)         config->pullers = brokers;
+    if (!config->batch)           config->batch = SMQ_BATCH;
+    if (!config->backoff)         config->backoff = SMQ_BACKOFF;
+    if (!config->retries)         config->retries = SMQ_RETRIES;
+    // Retries and backoff may be turned off, which only SMQ_DISABLED expresses
+    if (config->backoff == SMQ_DISABLED)         config->backoff = 0;
+    if (config->retries == (size_t)SMQ_DISABLED) config->retries = 0;
+    if (!config->failures)        config->failures = SMQ_FAILURES;
+    if (!config->cooldown)        config->cooldown = SMQ_COOLDOWN;
+    if (!config->vnodes)          config->vnodes = SMQ_VNODES;
+
+    if (config->timeout < 0 || config->connect_timeout < 0 || config->backoff < 0 || config->cooldown < 0 ||
+        config->ttl < 0) {
+        error("Invalid timeout: %ld (connect %ld, backoff %ld, cooldown %ld, ttl %ld)",
+            config->timeout, config->connect_timeout, config->backoff, config->cooldown, config->ttl);
+        return false;
+    }
+
+    if (config->pushers > SMQ_WORKERS_MAX || config->pullers > SMQ_WORKERS_MAX) {
+        error("Invalid number of workers: %lu pushers, %lu pullers (maximum %d)",
+            config->pushers, config->pullers, SMQ_WORKERS_MAX);
+        return false;
+    }
+
+    cpu_set_t cpus;
+    if (!smq_cpus(config->pusher.cpus, &cpus)) {
+        error("Invalid pusher CPU list: %s", config->pusher.cpus);
+        return false;
+    }
+    if (!smq_cpus(config->puller.cpus, &cpus)) {
+        error("Invalid puller CPU list: %s", config->puller.cpus);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Format URL for Simple Request Queue.
+ * @param   format  printf-style format string.
+ * @return  Newly allocated URL string (NULL on failure).
+ **/
+static char * smq_url(const char *format, ...) {
+    char   *url = NULL;
+    va_list args;
+
+    va_start(args, format);
+    if (vasprintf(&url, format, args) < 0) {
+        url = NULL;
+    }
+    va_end(args);
+    return url;
+}
+
+/**
+ * Wait before resending a failed Request (or until shutdown).
+ *
+ * The delay doubles with each attempt, starting at backoff and capped at
+ * SMQ_BACKOFF_MAX (and at the Request's own deadline).  It waits on stopped
+ * rather than window, so that the signal meant for a puller waiting on its
+ * prefetch window is never spent waking a pusher instead.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   attempt Number of resends so far.
+ * @param   limit   Deadline of Request being resent (0 for none).
+ **/
+static void smq_backoff(SMQ *smq, size_t attempt, Deadline limit) {
+    probe_scope(PROBE_BACKOFF);
+    time_t delay = smq->backoff << min(attempt, 16);
+    if (delay > SMQ_BACKOFF_MAX) delay = SMQ_BACKOFF_MAX;
+
+    Deadline deadline = deadline_after(delay);
+    if (limit && limit < deadline) deadline = limit;
+
+    mutex_lock(&smq->lock);
+    while (smq_running(smq)) {
+        if (deadline_wait(&smq->stopped, &smq->lock, deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    mutex_unlock(&smq->lock);
+}
+
+/**
+ * Health check broker whose circuit is open, and report the result.
+ * @param   smq     Simple Request Queue structure.
+ * @param   index   Index of endpoint to check.
+ * @return  Whether or not broker is back up.
+ **/
+static bool smq_probe(SMQ *smq, size_t index) {
+    Request *request = request_create("GET", NULL, NULL);
+    char    *response = NULL;
+
+    if (request && (request->url = smq_url("%s/health", smq->endpoints->endpoints[index].url))) {
+        request->connect = smq->connect_timeout;
+        response = request_perform(request, smq->connect_timeout);
+    }
+    request_delete(request);
+
+    endpoints_report(smq->endpoints, index, response != NULL);
+    free(response);
+    return response != NULL;
+}
+
+/**
+ * Perform Request on a healthy broker, failing over to the next one on error.
+ *
+ * Request URLs hold only the path (ie. /topic/$topic), and each attempt
+ * prefixes the URL of the broker chosen for it.  A broker that keeps failing
+ * is skipped until its circuit cooldown passes and a health check succeeds.
+ * Retries move on to another broker immediately, but back off when there is
+ * no other broker to try, so that an outage does not turn into a tight loop.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   request Request to perform (endpoint pins it to one broker, and
+ *                  is set to the broker that answered otherwise).
+ * @param   key     Key that picks broker on hash ring (NULL if not partitioned).
+ * @param   rotate  Whether to spread Requests over brokers (true) or prefer
+ *                  the first healthy one in list order (false).
+ * @param   retries Times to resend Request after broker failure.
+ * @return  Body of response (NULL if error, timeout, or no broker was reachable).
+ **/
+static char * smq_send(SMQ *smq, Request *request, const char *key, bool rotate, size_t retries) {
+    char    *path     = request->url;
+    char    *response = NULL;
+    bool     pinned   = request->endpoint > 0;
+    ssize_t  failed   = -1;     // Broker that failed last attempt
+    bool     retrying = false;
+
+    for (size_t attempt = 0; attempt <= retries && smq_running(smq); ) {
+        if (request->deadline && deadline_expired(request->deadline)) break;
+        if (attempt && !retrying) {
+            probe_begin(PROBE_SEND);
+            retrying = true;
+        }
+
+        bool    probe = false;
+        ssize_t index;
+        if (pinned) {
+            index = request->endpoint - 1;
+            if (!endpoints_check(smq->endpoints, index, &probe)) index = -1;
+        } else if (key) {
+            index = endpoints_owner(smq->endpoints, key, &probe);
+        } else {
+            index = endpoints_acquire(smq->endpoints, rotate, &probe);
+        }
+
+        if (index >= 0 && probe && !smq_probe(smq, index)) continue;
+        if (index < 0) {
+            smq_backoff(smq, attempt++, request->deadline);
+            continue;
+        }
+        if (index == failed) {
+            smq_backoff(smq, attempt - 1, request->deadline);
+        }
+
+        if (!(request->url = smq_url("%s%s", smq->endpoints->endpoints[index].url, path))) {
+            break;
+        }
+        response = request_perform(request, smq->timeout);
+        free(request->url);
+
+        endpoints_report(smq->endpoints, index, !request->offline);
+        if (response || !request->offline) {
+            request->endpoint = index + 1;
+            break;
+        }
+
+        failed = index;
+        attempt++;
+    }
+
+    if (retrying) probe_end(PROBE_SEND);
+    request->url = path;
+    return response;
+}
+
 /**
  * Pusher thread takes messages from outgoing queue and sends them to server.
  **/
 void * smq_pusher(void *arg) {
     SMQ *smq = (SMQ *)arg;
-    Queue *outgoing = smq->outgoing;
+    size_t pusher   = __atomic_fetch_add(&smq->pushing, 1, __ATOMIC_RELAXED);
+    Queue *outgoing = smq->lanes ? smq->lanes[pusher % smq->nlanes] : smq->outgoing;
 
     while (smq_running(smq)) {
         Request *request = queue_pop(outgoing, smq->timeout);
         if (!request) continue;
 
-        char *response = request_perform(request, smq->timeout);
-        if (!response) {
+        if (streq(request->method, "ACK") || streq(request->method, "NACK")) {
+            smq_settlements_take(smq, request);
+            if (!request->body || !*request->body) {
+                request_delete(request);
+                continue;
+            }
+        }
+
+        if (!smq_throttled(smq, request)) {     // Dropped or deferred
+            continue;
+        }
+
+        trace_stamp(request->trace, TRACE_DEQUEUE);
+        request->connect = smq->connect_timeout;
+        // Partitioned publishes go to the broker that owns their topic
+        const char *key = smq->partitioned ? request->url : NULL;
+        char *response  = smq_send(smq, request, key, false, smq->retries);
+        if (!response && request->deadline && deadline_expired(request->deadline)) {
+            error("Deadline passed before sending request for URL: %s", request->url);
+        } else if (!response && !smq_running(smq)) {
+            smq_unsent(smq, request);
+            continue;
+        } else if (!response) {
             fprintf(stderr, "ERROR: Failed to send request for URL: %s\n", request->url);
+        } else if (request->trace) {
+            trace_stamp(request->trace, TRACE_SENT);
+            tracer_record(&smq->tracer, request->trace, TRACE_DEQUEUE);
+            tracer_record(&smq->tracer, request->trace, TRACE_SENT);
         }
         free(response); // free(NULL) is safe.
 
@@ -207,38 +1593,137 @@ void * smq_pusher(void *arg) {
     return NULL;
 }
 
+/**
+ * Timer thread moves scheduled messages to outgoing queue once they are due.
+ **/
+void * smq_timer(void *arg) {
+    SMQ *smq = (SMQ *)arg;
+
+    while (smq_running(smq)) {
+        Request *request = wheel_take(smq->scheduled, DEADLINE_NEVER);
+        while (request) {
+            Request *next = request->next;
+            request->next = NULL;
+            request->due  = 0;
+            // Messages deferred by rate limits keep the deadline they had
+            if (smq->ttl && !request->throttled) {
+                request->deadline = deadline_after(smq->ttl);
+            }
+
+            if (!queue_push(smq_outgoing(smq, request), request)) {
+                smq_unsent(smq, request);
+            }
+            request = next;
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * Puller thread requests new messages from server and then puts them in
  * incoming queue.
  **/
 void * smq_puller(void *arg) {
     SMQ *smq = (SMQ *)arg;
-    Queue *incoming = smq->incoming;
     const char *method = "GET";
-    char url[1024];
+    size_t idle = 0;            // Consecutive fetches that found nothing
+
+    // With a puller per broker, each keeps long polling its own broker so
+    // that every broker holding our queue is drained in parallel
+    size_t brokers  = smq->endpoints->count;
+    size_t puller   = __atomic_fetch_add(&smq->started, 1, __ATOMIC_RELAXED);
+    size_t endpoint = brokers > 1 && smq->npullers >= brokers ? puller % brokers + 1 : 0;
 
     while (smq_running(smq)) {
-        snprintf(url, sizeof url, "%s/queue/%s", smq->server_url, smq->name);
+        // Wait for the prefetch window to open before leasing more messages
+        mutex_lock(&smq->lock);
+        while (smq->prefetch && smq->unacked >= smq->prefetch && smq_running(smq)) {
+            smq_expire(smq);
+            if (smq->unacked < smq->prefetch) break;
+
+            deadline_wait(&smq->window, &smq->lock, deadline_after(smq->timeout));
+        }
+        size_t prefetch = smq->prefetch;
+        SMQQueue *source = smq_rotate(smq);
+        size_t   sources = smq->nqueues;
+        Queue  *incoming = source->incoming;
+        mutex_unlock(&smq->lock);
+
+        // With several queues, each only gets a quick poll, so that an idle
+        // one does not hold up the rest; once they all came up empty, a
+        // round of polls waits SMQ_POLL in total for the next message
+        long wait = -1;
+        char poll[32] = "";
+        if (sources > 1) {
+            wait = idle < sources ? 0 : (SMQ_POLL + (long)sources - 1) / (long)sources;
+            snprintf(poll, sizeof(poll), "%swait=%ld", prefetch ? "&" : "?", wait);
+        }
+
+        // Only fetch a message once incoming has a slot (credit) for it, so
+        // that the backlog stays on the broker while the application lags
+        if (!queue_reserve(incoming, wait < 0 ? smq->timeout : wait)) {
+            idle++;
+            continue;
+        }
 
-        Request *req = request_create(method, url, NULL);
-        if (!req) continue;
+        // Count the lease against the window up front, so that several
+        // pullers cannot overshoot it between them
+        if (prefetch) {
+            mutex_lock(&smq->lock);
+            smq->unacked++;
+            mutex_unlock(&smq->lock);
+        }
+
+        Request *req  = request_create(method, NULL, NULL);
+        char    *body = NULL;
+        if (req) {
+            if (prefetch) {
+                req->url = smq_url("/queue/%s?lease=%lu%s", source->name, smq->lease, poll);
+            } else {
+                req->url = smq_url("/queue/%s%s", source->name, poll);
+            }
+            req->connect = smq->connect_timeout;
+
+            // Otherwise take turns fetching from each healthy broker
+            req->endpoint = endpoint;
+            body = req->url ? smq_send(smq, req, NULL, true, smq->retries) : NULL;
+        }
 
-        char *body = request_perform(req, smq->timeout);
-        request_delete(req);
-        
-        if (!body) { // This will now only happen on a real error or shutdown
+        if (prefetch && !(body && req->id)) {
+            mutex_lock(&smq->lock);
+            if (smq->unacked) smq->unacked--;
+            cond_signal(&smq->window);
+            mutex_unlock(&smq->lock);
+        }
+
+        if (!body) { // This will now only happen on a real error, shutdown, or poll
+            request_delete(req);
+            queue_release(incoming);
+            idle++;
             continue;
         }
+        idle = 0;
 
-        // Create a new request to hold the body and transfer ownership of the pointer
-        Request *deliver = calloc(1, sizeof(Request));
-        if (!deliver) { 
-            free(body); 
-            continue; 
+        if (req->trace) {
+            trace_stamp(req->trace, TRACE_RECEIVE);
+            tracer_record(&smq->tracer, req->trace, TRACE_BROKER);
+            tracer_record(&smq->tracer, req->trace, TRACE_RECEIVE);
         }
-        deliver->body = body; // Take ownership of the allocated pointer
 
-        queue_push(incoming, deliver);
+        // Deliver the GET Request itself, with the response buffer as its
+        // body (its id, trace, and endpoint already describe the message)
+        free(req->method);
+        free(req->url);
+        req->method = NULL;
+        req->url    = NULL;
+        req->body   = body;
+        req->length = req->received;
+
+        if (!queue_commit(incoming, req)) {
+            // Shut down while fetching (a leased message is redelivered)
+            request_delete(req);
+        }
     }
 
     return NULL;
@@ -0,0 +1,84 @@
+/* deadline.c: SMQ Monotonic Deadlines */
+
+#define _GNU_SOURCE     // pthread_cond_clockwait
+
+#include "smq/deadline.h"
+
+#include <limits.h>
+
+/* Functions */
+
+/**
+ * Return deadline timeout milliseconds from now.
+ *
+ * Deadlines are measured on CLOCK_MONOTONIC, so wall clock steps (ie. from
+ * NTP) neither shorten nor stretch a wait.
+ *
+ * @param   timeout     Milliseconds from now (negative for never).
+ * @return  Absolute deadline.
+ **/
+Deadline deadline_after(long timeout) {
+    if (timeout < 0) return DEADLINE_NEVER;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec + (uint64_t)timeout * 1000000;
+}
+
+/**
+ * Return whether deadline has passed.
+ * @param   deadline    Absolute deadline.
+ **/
+bool deadline_expired(Deadline deadline) {
+    return deadline != DEADLINE_NEVER && deadline_remaining(deadline) == 0;
+}
+
+/**
+ * Return milliseconds left until deadline (rounded up, so that a wait for
+ * the result does not wake up just before the deadline).
+ * @param   deadline    Absolute deadline.
+ * @return  Milliseconds left (0 if passed, LONG_MAX if never).
+ **/
+long deadline_remaining(Deadline deadline) {
+    if (deadline == DEADLINE_NEVER) return LONG_MAX;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t current = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    if (current >= deadline) return 0;
+
+    uint64_t left = (deadline - current + 999999) / 1000000;
+    return left > LONG_MAX ? LONG_MAX : (long)left;
+}
+
+/**
+ * Convert deadline to absolute CLOCK_MONOTONIC timespec.
+ * @param   deadline    Absolute deadline.
+ **/
+struct timespec deadline_timespec(Deadline deadline) {
+    return (struct timespec){
+        .tv_sec  = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+}
+
+/**
+ * Wait on condition variable until signaled or deadline passes.
+ * @param   cond        Condition variable.
+ * @param   lock        Mutex held by caller.
+ * @param   deadline    Absolute deadline (DEADLINE_NEVER to wait indefinitely).
+ * @return  0 if woken up (possibly spuriously), ETIMEDOUT if deadline passed.
+ **/
+int deadline_wait(Cond *cond, Mutex *lock, Deadline deadline) {
+    if (deadline == DEADLINE_NEVER) {
+        cond_wait(cond, lock);
+        return 0;
+    }
+
+    struct timespec ts = deadline_timespec(deadline);
+    int rc = pthread_cond_clockwait(cond, lock, CLOCK_MONOTONIC, &ts);
+    PTHREAD_CHECK(rc);
+    return rc;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,341 @@
+/* endpoint.c: SMQ Broker Endpoints (with circuit breakers) */
+
+#define _GNU_SOURCE     // asprintf
+
+#include "smq/endpoint.h"
+#include "smq/trace.h"
+#include "smq/utils.h"
+
+#include <stdio.h>
+
+/* Constants */
+
+#define ENDPOINT_COOLDOWN_MAX   (30000000000ULL)    // Nanoseconds
+
+/* Internal Functions */
+
+/**
+ * Return 64-bit hash of string (FNV-1a, then mixed so that similar strings
+ * such as virtual node names land far apart on the ring).
+ **/
+static uint64_t endpoints_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int endpoints_compare(const void *a, const void *b) {
+    uint64_t x = ((const EndpointNode *)a)->hash;
+    uint64_t y = ((const EndpointNode *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Return position of first virtual node at or after key's hash (Endpoints
+ * lock must be held, ring must not be empty).
+ **/
+static size_t endpoints_search(Endpoints *e, const char *key) {
+    uint64_t hash = endpoints_hash(key);
+    size_t   low  = 0;
+    size_t   high = e->nodes;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (e->ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low % e->nodes;      // Wrap around past the last node
+}
+
+/**
+ * Return whether endpoint may be used now (Endpoints lock must be held).
+ *
+ * Closed circuits are usable.  Once an open circuit's cooldown passes, the
+ * first caller gets it with probe set, and must health check it and report
+ * the result before anyone else may use it.
+ **/
+static bool endpoints_usable(Endpoint *endpoint, uint64_t now, bool *probe) {
+    if (!endpoint->retry_at) return true;
+
+    if (!endpoint->probing && now >= endpoint->retry_at) {
+        endpoint->probing = true;
+        *probe = true;
+        return true;
+    }
+
+    return false;
+}
+
+/* Functions */
+
+/**
+ * Create Endpoints from comma separated list of brokers.
+ *
+ * Each broker is either a complete URL (ie. smq://local), host:port, or a
+ * bare host that is combined with port.
+ *
+ * @param   hosts       Comma separated brokers in order of preference.
+ * @param   port        Port for brokers that do not name one.
+ * @param   threshold   Consecutive failures that open a circuit (0 for 1).
+ * @param   cooldown    Time circuit stays open before it is probed (milliseconds).
+ * @return  Newly allocated Endpoints structure (NULL if hosts is empty or invalid).
+ **/
+Endpoints * endpoints_create(const char *hosts, const char *port, size_t threshold, time_t cooldown) {
+    if (!hosts || !port) return NULL;
+
+    Endpoints *e = calloc(1, sizeof(Endpoints));
+    if (!e) return NULL;
+
+    e->threshold = threshold ? threshold : 1;
+    e->cooldown  = (uint64_t)cooldown * 1000000;
+    mutex_init(&e->lock, NULL);
+
+    for (const char *s = hosts; *s; ) {
+        size_t length = strcspn(s, ",");
+        if (length) {
+            Endpoint *endpoints = realloc(e->endpoints, (e->count + 1) * sizeof(Endpoint));
+            if (!endpoints) {
+                endpoints_delete(e);
+                return NULL;
+            }
+            e->endpoints = endpoints;
+
+            Endpoint *endpoint = &e->endpoints[e->count];
+            *endpoint = (Endpoint){ .cooldown = e->cooldown };
+
+            char host[length + 1];
+            memcpy(host, s, length);
+            host[length] = 0;
+
+            int rc;
+            if (strstr(host, "://")) {
+                endpoint->url = strdup(host);
+                rc = endpoint->url ? 0 : -1;
+            } else if (strchr(host, ':')) {
+                rc = asprintf(&endpoint->url, "http://%s", host);
+            } else {
+                rc = asprintf(&endpoint->url, "http://%s:%s", host, port);
+            }
+            if (rc < 0) {
+                endpoints_delete(e);
+                return NULL;
+            }
+            e->count++;
+        }
+
+        s += length;
+        if (*s == ',') s++;
+    }
+
+    if (!e->count) {
+        endpoints_delete(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+/**
+ * Delete Endpoints structure.
+ * @param   e           Endpoints structure.
+ **/
+void endpoints_delete(Endpoints *e) {
+    if (!e) return;
+
+    for (size_t i = 0; i < e->count; i++) {
+        free(e->endpoints[i].url);
+    }
+    free(e->endpoints);
+    free(e->ring);
+    mutex_destroy(&e->lock);
+    free(e);
+}
+
+/**
+ * Spread keys over endpoints by consistent hashing.
+ *
+ * Each endpoint is placed on a hash ring at vnodes points, and a key belongs
+ * to the endpoint at the first point at or after its hash.  Adding or losing
+ * a broker thus only moves the keys next to its points, and the virtual
+ * nodes keep each broker's share of keys close to even.
+ *
+ * @param   e           Endpoints structure.
+ * @param   vnodes      Virtual nodes per endpoint.
+ * @return  Whether or not ring was built.
+ **/
+bool endpoints_partition(Endpoints *e, size_t vnodes) {
+    if (!e || !vnodes) return false;
+
+    EndpointNode *ring = calloc(e->count * vnodes, sizeof(EndpointNode));
+    if (!ring) return false;
+
+    char name[BUFSIZ];
+    for (size_t i = 0; i < e->count; i++) {
+        for (size_t v = 0; v < vnodes; v++) {
+            snprintf(name, sizeof(name), "%s#%lu", e->endpoints[i].url, v);
+            ring[i * vnodes + v] = (EndpointNode){ endpoints_hash(name), i };
+        }
+    }
+    qsort(ring, e->count * vnodes, sizeof(EndpointNode), endpoints_compare);
+
+    mutex_lock(&e->lock);
+    free(e->ring);
+    e->ring  = ring;
+    e->nodes = e->count * vnodes;
+    mutex_unlock(&e->lock);
+    return true;
+}
+
+/**
+ * Choose endpoint for next Request.
+ * @param   e           Endpoints structure.
+ * @param   rotate      Whether to spread Requests over endpoints (true) or
+ *                      prefer the first healthy one in list order (false).
+ * @param   probe       Set to whether endpoint must be health checked first.
+ * @return  Index of endpoint (-1 if every circuit is open).
+ **/
+ssize_t endpoints_acquire(Endpoints *e, bool rotate, bool *probe) {
+    ssize_t index = -1;
+    uint64_t now  = trace_now();
+
+    *probe = false;
+
+    mutex_lock(&e->lock);
+    size_t start = rotate ? e->cursor++ % e->count : 0;
+    for (size_t i = 0; i < e->count && index < 0; i++) {
+        size_t candidate = (start + i) % e->count;
+        if (endpoints_usable(&e->endpoints[candidate], now, probe)) {
+            index = candidate;
+        }
+    }
+    mutex_unlock(&e->lock);
+
+    return index;
+}
+
+/**
+ * Choose endpoint that owns key on the hash ring.
+ *
+ * If the owner's circuit is open, the key moves to the next healthy endpoint
+ * clockwise, so only the failed broker's keys are redistributed.
+ *
+ * @param   e           Endpoints structure (partitioned).
+ * @param   key         Key to place (ie. topic).
+ * @param   probe       Set to whether endpoint must be health checked first.
+ * @return  Index of endpoint (-1 if every circuit is open).
+ **/
+ssize_t endpoints_owner(Endpoints *e, const char *key, bool *probe) {
+    uint64_t now   = trace_now();
+    ssize_t  index = -1;
+
+    *probe = false;
+
+    mutex_lock(&e->lock);
+    if (!e->nodes) {
+        mutex_unlock(&e->lock);
+        return endpoints_acquire(e, false, probe);
+    }
+
+    size_t low = endpoints_search(e, key);
+    for (size_t i = 0; i < e->nodes && index < 0; i++) {
+        size_t candidate = e->ring[(low + i) % e->nodes].index;
+        if (endpoints_usable(&e->endpoints[candidate], now, probe)) {
+            index = candidate;
+        }
+    }
+    mutex_unlock(&e->lock);
+
+    return index;
+}
+
+/**
+ * Return endpoint that owns key on the hash ring while every broker is up.
+ *
+ * Unlike endpoints_owner, this ignores circuits, so a key always maps to the
+ * same endpoint (ie. to pick which pusher sends it, keeping its order).
+ *
+ * @param   e           Endpoints structure.
+ * @param   key         Key to place (ie. topic).
+ * @return  Index of endpoint (0 if not partitioned).
+ **/
+size_t endpoints_home(Endpoints *e, const char *key) {
+    size_t index = 0;
+
+    mutex_lock(&e->lock);
+    if (e->nodes) {
+        index = e->ring[endpoints_search(e, key)].index;
+    }
+    mutex_unlock(&e->lock);
+
+    return index;
+}
+
+/**
+ * Check whether a specific endpoint may be used now.
+ * @param   e           Endpoints structure.
+ * @param   index       Index of endpoint.
+ * @param   probe       Set to whether endpoint must be health checked first.
+ * @return  Whether or not endpoint may be used.
+ **/
+bool endpoints_check(Endpoints *e, size_t index, bool *probe) {
+    bool usable;
+
+    *probe = false;
+    if (index >= e->count) return false;
+
+    mutex_lock(&e->lock);
+    usable = endpoints_usable(&e->endpoints[index], trace_now(), probe);
+    mutex_unlock(&e->lock);
+    return usable;
+}
+
+/**
+ * Record outcome of Request (or health check) sent to endpoint.
+ *
+ * A success closes the circuit.  A failed health check, or threshold
+ * consecutive failed Requests, opens it for a cooldown that doubles each time
+ * it trips again (up to ENDPOINT_COOLDOWN_MAX).
+ *
+ * @param   e           Endpoints structure.
+ * @param   index       Index of endpoint.
+ * @param   healthy     Whether the broker could be reached.
+ **/
+void endpoints_report(Endpoints *e, size_t index, bool healthy) {
+    if (!e || index >= e->count) return;
+
+    mutex_lock(&e->lock);
+    Endpoint *endpoint = &e->endpoints[index];
+    if (healthy) {
+        if (endpoint->retry_at) {
+            info("Broker %s is available again", endpoint->url);
+        }
+        endpoint->failures = 0;
+        endpoint->retry_at = 0;
+        endpoint->cooldown = e->cooldown;
+        endpoint->probing  = false;
+    } else {
+        endpoint->failures++;
+        if (endpoint->probing || (!endpoint->retry_at && endpoint->failures >= e->threshold)) {
+            if (!endpoint->retry_at) {
+                error("Broker %s is unavailable (%lu failures)", endpoint->url, endpoint->failures);
+            }
+            endpoint->retry_at = trace_now() + endpoint->cooldown;
+            endpoint->cooldown = min(endpoint->cooldown * 2, ENDPOINT_COOLDOWN_MAX);
+            endpoint->probing  = false;
+        }
+    }
+    mutex_unlock(&e->lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,203 @@
+/* probe.c: SMQ Compile-Time Optional Trace Points */
+
+#define _GNU_SOURCE     // pthread_getname_np
+
+#include "smq/probe.h"
+#include "smq/trace.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#ifdef SMQ_PROBES
+
+/* Globals */
+
+__thread ProbeRing *probe_ring = NULL;
+
+static ProbeRing   *ProbeRings = NULL;      // Every ring, reused once its events are exported
+static size_t       ProbeCount = 0;         // Number of rings
+static pthread_key_t ProbeKey;              // Calls probe_detach when thread exits
+static pthread_once_t ProbeOnce = PTHREAD_ONCE_INIT;
+static uint64_t     ProbeClock = 0;         // probe_clock() at first event
+static uint64_t     ProbeStart = 0;         // trace_now() at first event
+
+static const char *ProbeNames[] = {
+    [PROBE_QUEUE_PUSH]      = "queue_push (wait)",
+    [PROBE_QUEUE_POP]       = "queue_pop (wait)",
+    [PROBE_QUEUE_RESERVE]   = "queue_reserve (wait)",
+    [PROBE_THROTTLE]        = "smq_throttle",
+    [PROBE_SEND]            = "smq_send (retry)",
+    [PROBE_BACKOFF]         = "smq_backoff",
+    [PROBE_CURL]            = "curl_easy_perform",
+    [PROBE_WRITER]          = "request_writer",
+};
+
+/* Internal Functions */
+
+/**
+ * Mark ring of exiting thread, so it is reused once probe_export wrote it.
+ **/
+static void probe_detach(void *ring) {
+    probe_ring = NULL;
+    __atomic_store_n(&((ProbeRing *)ring)->state, PROBE_RING_EXITED, __ATOMIC_RELEASE);
+}
+
+/**
+ * Claim first ring in state for calling thread.
+ * @return  Claimed ring (NULL if none is in state).
+ **/
+static ProbeRing * probe_claim(int state) {
+    ProbeRing *ring = __atomic_load_n(&ProbeRings, __ATOMIC_ACQUIRE);
+    for (int expected = state; ring; ring = ring->next, expected = state) {
+        if (__atomic_compare_exchange_n(&ring->state, &expected, PROBE_RING_RUNNING, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    return ring;
+}
+
+/**
+ * Move every ring in state from to state to.
+ **/
+static void probe_mark(int from, int to) {
+    for (ProbeRing *ring = __atomic_load_n(&ProbeRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int expected = from;
+        __atomic_compare_exchange_n(&ring->state, &expected, to, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+static void probe_init() {
+    pthread_key_create(&ProbeKey, probe_detach);
+}
+
+/* Functions */
+
+/**
+ * Give calling thread a ring of events (on its first event).
+ *
+ * Rings outlive their threads, so that probe_export still sees the events
+ * of threads that were joined (ie. by smq_delete) before it was called.
+ * Once exported, they are reused by threads started later, so a process
+ * that keeps creating and deleting clients (and exports now and then) only
+ * holds as many rings as it had threads running at once.  One that never
+ * exports stops at PROBE_RINGS, after which rings of exited threads are
+ * reused anyway (losing their events).
+ *
+ * @return  Calling thread's ring (NULL if it could not be allocated).
+ **/
+ProbeRing * probe_attach() {
+    pthread_once(&ProbeOnce, probe_init);
+
+    ProbeRing *ring = probe_claim(PROBE_RING_IDLE);
+    if (!ring && __atomic_load_n(&ProbeCount, __ATOMIC_RELAXED) >= PROBE_RINGS) {
+        ring = probe_claim(PROBE_RING_EXITED);
+    }
+
+    if (ring) {
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    } else if ((ring = calloc(1, sizeof(ProbeRing)))) {
+        __atomic_add_fetch(&ProbeCount, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&ProbeRings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ProbeRings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    } else {
+        return NULL;
+    }
+
+    ring->thread = syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+    uint64_t zero = 0;
+    uint64_t now  = trace_now();
+    if (__atomic_compare_exchange_n(&ProbeStart, &zero, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ProbeClock, probe_clock(), __ATOMIC_RELEASE);
+    }
+
+    pthread_setspecific(ProbeKey, ring);
+    probe_ring = ring;
+    return ring;
+}
+
+/**
+ * Write events recorded so far as a Chrome trace (JSON array format).
+ *
+ * Load the file in chrome://tracing or ui.perfetto.dev for a flame chart of
+ * each thread: every stage is a slice, nested inside the stage that called
+ * it.  Threads keep recording while the file is written, so call this once
+ * the client is idle (ie. after smq_delete) for a consistent picture.  Rings
+ * of threads that exited may be reused once the file is written.
+ *
+ * @param   path    Path of trace file.
+ * @return  Whether or not trace was written.
+ **/
+bool probe_export(const char *path) {
+    FILE *stream = path ? fopen(path, "w") : NULL;
+    if (!stream) {
+        error("Unable to create trace %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    // Convert clock ticks to microseconds using the time since first event
+    uint64_t clock = __atomic_load_n(&ProbeClock, __ATOMIC_ACQUIRE);
+    uint64_t start = __atomic_load_n(&ProbeStart, __ATOMIC_RELAXED);
+    uint64_t ticks = probe_clock() - clock;
+    double   scale = ticks ? (trace_now() - start) / 1000.0 / ticks : 0;
+    int      pid   = getpid();
+    bool     first = true;
+
+    // Rings of exited threads are not reused while they are written
+    probe_mark(PROBE_RING_EXITED, PROBE_RING_EXPORTING);
+
+    fputs("[", stream);
+    for (ProbeRing *ring = __atomic_load_n(&ProbeRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        fprintf(stream, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", pid, ring->thread, ring->name);
+        first = false;
+
+        uint64_t head   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t oldest = head > PROBE_EVENTS ? head - PROBE_EVENTS : 0;
+        size_t   depth  = 0;
+
+        for (uint64_t i = oldest; i < head; i++) {
+            const ProbeEvent *event = &ring->events[i & (PROBE_EVENTS - 1)];
+            if (event->stage >= PROBE_STAGES) continue;
+
+            // Skip ends whose beginning was overwritten
+            if (event->phase == 'E' && !depth) continue;
+            depth += event->phase == 'B' ? 1 : -1;
+
+            fprintf(stream, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d}",
+                    ProbeNames[event->stage], event->phase,
+                    event->clock > clock ? (event->clock - clock) * scale : 0, pid, ring->thread);
+        }
+    }
+    fputs("\n]\n", stream);
+
+    if (fclose(stream) != 0) {
+        error("Unable to write trace %s: %s", path, strerror(errno));
+        probe_mark(PROBE_RING_EXPORTING, PROBE_RING_EXITED);
+        return false;
+    }
+    probe_mark(PROBE_RING_EXPORTING, PROBE_RING_IDLE);
+    return true;
+}
+
+#else
+
+/**
+ * Write events recorded so far as a Chrome trace (JSON array format).
+ * @param   path    Path of trace file.
+ * @return  false, since the library was built without trace points.
+ **/
+bool probe_export(const char *path) {
+    error("Unable to write trace %s: built without SMQ_PROBES", path);
+    errno = ENOTSUP;
+    return false;
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
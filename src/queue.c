@@ -1,5 +1,6 @@
 /* queue.c: Concurrent Queue of Requests */
 
+#include "smq/probe.h"
 #include "smq/queue.h"
 #include "smq/utils.h"
 
@@ -10,8 +11,276 @@
 #define QUEUE_CAPACITY (4096)
 #endif
 
+#ifndef QUEUE_BUCKETS
+#define QUEUE_BUCKETS (64)
+#endif
+
+#ifndef QUEUE_MAX_BYTES
+#define QUEUE_MAX_BYTES (64<<20)
+#endif
+
+/* Internal Functions */
+
+/**
+ * Return number of bytes Request counts against queue's byte limits.
+ * @param   r       Request structure.
+ **/
+static size_t queue_weight(Request *r) {
+    return r->body ? r->length : 0;
+}
+
+/**
+ * Return FNV-1a hash of keyed Request's url and key.
+ * @param   r       Request structure.
+ **/
+static size_t queue_hash(Request *r) {
+    size_t hash = 2166136261u;
+    for (const char *s = r->url ? r->url : ""; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    hash = (hash ^ 0xff) * 16777619u;
+    for (const char *s = r->key; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Return whether or not two keyed Requests conflate (same url and key).
+ * @param   a       Keyed Request structure.
+ * @param   b       Keyed Request structure.
+ **/
+static bool queue_same_key(Request *a, Request *b) {
+    return streq(a->key, b->key) && streq(a->url ? a->url : "", b->url ? b->url : "");
+}
+
+/**
+ * Find queued Request with same url and key (queue lock must be held).
+ * @param   q       Queue structure.
+ * @param   r       Keyed Request structure.
+ * @return  Queued Request structure (NULL if none).
+ **/
+static Request * queue_find(Queue *q, Request *r) {
+    if (!q->buckets) return NULL;
+
+    for (Request *c = q->index[queue_hash(r) & (q->buckets - 1)]; c; c = c->chain) {
+        if (queue_same_key(c, r)) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add keyed Request to index (queue lock must be held).
+ *
+ * The index doubles whenever it holds more Requests than buckets, so chains
+ * stay short no matter how many keys are in flight.
+ *
+ * @param   q       Queue structure.
+ * @param   r       Keyed Request structure.
+ **/
+static void queue_index(Queue *q, Request *r) {
+    if (q->keyed >= q->buckets) {
+        size_t    buckets = q->buckets ? q->buckets * 2 : QUEUE_BUCKETS;
+        Request **index   = calloc(buckets, sizeof(Request *));
+        if (!index) {
+            // Without an index, Request is simply never conflated
+            r->chain = NULL;
+            return;
+        }
+
+        for (size_t b = 0; b < q->buckets; b++) {
+            Request *c = q->index[b];
+            while (c) {
+                Request *next = c->chain;
+                size_t   i    = queue_hash(c) & (buckets - 1);
+                c->chain = index[i];
+                index[i] = c;
+                c = next;
+            }
+        }
+
+        free(q->index);
+        q->index   = index;
+        q->buckets = buckets;
+    }
+
+    size_t i = queue_hash(r) & (q->buckets - 1);
+    r->chain    = q->index[i];
+    q->index[i] = r;
+    q->keyed++;
+}
+
+/**
+ * Remove keyed Request from index (queue lock must be held).
+ * @param   q       Queue structure.
+ * @param   r       Keyed Request structure.
+ **/
+static void queue_unindex(Queue *q, Request *r) {
+    if (!q->buckets) return;
+
+    for (Request **c = &q->index[queue_hash(r) & (q->buckets - 1)]; *c; c = &(*c)->chain) {
+        if (*c == r) {
+            *c = r->chain;
+            r->chain = NULL;
+            q->keyed--;
+            return;
+        }
+    }
+}
+
+/**
+ * Replace contents of queued Request with newer Request (queue lock must be held).
+ *
+ * The queued Request keeps its place in line, so a conflated key is sent no
+ * later than its first unsent update would have been.
+ *
+ * @param   q       Queue structure.
+ * @param   old     Queued Request structure.
+ * @param   r       Newer Request structure (deleted).
+ **/
+static void queue_replace(Queue *q, Request *old, Request *r) {
+    q->bytes -= queue_weight(old);
+    q->bytes += queue_weight(r);
+
+    char  *body   = old->body;
+    size_t length = old->length;
+    Trace *trace  = old->trace;
+    old->body     = r->body;
+    old->length   = r->length;
+    old->trace    = r->trace;
+    old->deadline = r->deadline;
+    r->body       = body;
+    r->length     = length;
+    r->trace      = trace;
+    request_delete(r);
+}
+
+/**
+ * Append Request to the back of queue (queue lock must be held).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @param   bytes   Size of Request.
+ **/
+static void queue_append(Queue *q, Request *r, size_t bytes) {
+    r->next = NULL;
+    if (q->tail) {
+        q->tail->next = r;
+        q->tail = r;
+    } else {
+        q->head = q->tail = r;
+    }
+    q->size++;
+    q->bytes += bytes;
+
+    if (r->key) {
+        queue_index(q, r);
+    }
+
+    if (q->high && q->bytes >= q->high) {
+        q->throttled = true;
+    }
+
+    cond_signal(&q->produced);
+}
+
+/**
+ * Return whether or not queue must refuse Request (queue lock must be held).
+ *
+ * Note: a single Request larger than max_bytes is still accepted once the
+ * queue is empty, otherwise its producer would wait forever.
+ *
+ * @param   q       Queue structure.
+ * @param   bytes   Size of Request to push.
+ **/
+static bool queue_full(Queue *q, size_t bytes) {
+    return q->size + q->reserved >= q->capacity || q->throttled ||
+           (q->max_bytes && q->size && q->bytes + bytes > q->max_bytes);
+}
+
+/**
+ * Unlink Request at the front of queue (queue lock must be held).
+ * @param   q       Queue structure.
+ * @return  Unlinked Request structure.
+ **/
+static Request * queue_shift(Queue *q) {
+    Request *value = q->head;
+
+    q->head = q->head->next;
+    if (!q->head) {
+        q->tail = NULL;
+    }
+    q->size--;
+    q->bytes -= queue_weight(value);
+
+    if (value->key) {
+        queue_unindex(q, value);
+    }
+
+    if (q->throttled && q->bytes <= q->low) {
+        q->throttled = false;
+    }
+
+    // Broadcast since producers and queue_writable callers share consumed
+    cond_broadcast(&q->consumed);
+    return value;
+}
+
+/**
+ * Return Request at the front of queue, first unlinking expired ones onto
+ * expired (queue lock must be held).
+ *
+ * Each expired Request is looked at once, on its way out, so expiry costs
+ * O(1) amortized per Request and nothing scans the queue.
+ *
+ * @param   q       Queue structure.
+ * @param   expired List to prepend expired Requests to.
+ * @return  Request structure at front of queue (NULL if empty).
+ **/
+static Request * queue_next(Queue *q, Request **expired) {
+    Deadline now = 0;
+
+    while (q->head && q->head->deadline) {
+        if (!now) now = deadline_after(0);
+        if (q->head->deadline > now) break;
+
+        Request *r = queue_shift(q);
+        r->next  = *expired;
+        *expired = r;
+        q->expired++;
+    }
+
+    return q->head;
+}
+
+/**
+ * Hand expired Requests to queue's expire function (or delete them).
+ * @param   q       Queue structure.
+ * @param   expired List of expired Requests.
+ **/
+static void queue_discard(Queue *q, Request *expired) {
+    while (expired) {
+        Request *next = expired->next;
+        expired->next = NULL;
+        if (q->expire) {
+            q->expire(expired, q->expire_arg);
+        } else {
+            request_delete(expired);
+        }
+        expired = next;
+    }
+}
+
+/* Functions */
+
 /**
  * Create queue structure.
+ *
+ * By default, the queue holds up to QUEUE_CAPACITY Requests and
+ * QUEUE_MAX_BYTES bytes, and producers are throttled between 3/4 and 1/2 of
+ * the byte limit (see queue_limit).
+ *
  * @return  Newly allocated queue structure.
  **/
 Queue * queue_create() {
@@ -20,12 +289,15 @@ Queue * queue_create() {
     if (q) {
         q->head    = NULL;
         q->tail    = NULL;
-        q->size    = 0;
-        q->running = true;
+        q->size     = 0;
+        q->running  = true;
+        q->capacity = QUEUE_CAPACITY;
+
+        mutex_init(&q->lock, NULL);
+        cond_init(&q->produced, NULL);
+        cond_init(&q->consumed, NULL);
 
-        sem_init(&q->lock, 0, 1);
-        sem_init(&q->produced, 0, 0);
-        sem_init(&q->consumed, 0, QUEUE_CAPACITY);
+        queue_limit(q, QUEUE_MAX_BYTES, QUEUE_MAX_BYTES / 4 * 3, QUEUE_MAX_BYTES / 2);
     }
 
     return q;
@@ -37,122 +309,300 @@ Queue * queue_create() {
  **/
 void queue_delete(Queue *q) {
     if (q) {
-        sem_wait(&q->lock);
+        mutex_lock(&q->lock);
         Request *cur = q->head;
         while (cur) {
             Request *next = cur->next;
             request_delete(cur);
             cur = next;
         }
-        q->head = q->tail = NULL;
-        q->size = 0;
-        sem_post(&q->lock);
+        q->head  = q->tail = NULL;
+        q->size  = 0;
+        q->bytes = 0;
+        free(q->index);
+        mutex_unlock(&q->lock);
 
-        sem_destroy(&q->produced);
-        sem_destroy(&q->consumed);
-        sem_destroy(&q->lock);
+        cond_destroy(&q->produced);
+        cond_destroy(&q->consumed);
+        mutex_destroy(&q->lock);
 
         free(q);
     }
 }
 
 /**
- * Shutdown queue.
+ * Shutdown queue (wakes up every blocked producer and consumer).
  * @param   q       Queue structure.
  **/
 void queue_shutdown(Queue *q) {
-    sem_wait(&q->lock);
+    mutex_lock(&q->lock);
     q->running = false;
-    sem_post(&q->lock);
+    cond_broadcast(&q->produced);
+    cond_broadcast(&q->consumed);
+    mutex_unlock(&q->lock);
+}
 
-    // This is a broadcast mechanism. By posting many times, we ensure that any
-    // thread currently blocked on the semaphores will wake up.
-    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
-        sem_post(&q->produced);
-        sem_post(&q->consumed);
-    }
+/**
+ * Limit the number of body bytes the queue holds.
+ *
+ * Once bytes reaches the high watermark, producers block until consumers
+ * drain the queue back down to the low watermark, so a burst of large
+ * messages is absorbed in one step instead of waking producers per message.
+ *
+ * @param   q           Queue structure.
+ * @param   max_bytes   Maximum body bytes (0 for unlimited).
+ * @param   high        High watermark (0 disables throttling).
+ * @param   low         Low watermark (clamped to high).
+ **/
+void queue_limit(Queue *q, size_t max_bytes, size_t high, size_t low) {
+    if (!q) return;
+
+    mutex_lock(&q->lock);
+    q->max_bytes = max_bytes;
+    q->high      = high;
+    q->low       = min(low, high);
+    q->throttled = q->high && q->bytes >= q->high;
+    cond_broadcast(&q->consumed);
+    mutex_unlock(&q->lock);
+}
+
+/**
+ * Set the maximum number of Requests the queue holds.
+ * @param   q           Queue structure.
+ * @param   capacity    Maximum number of Requests (at least 1).
+ **/
+void queue_capacity(Queue *q, size_t capacity) {
+    if (!q) return;
+
+    mutex_lock(&q->lock);
+    q->capacity = capacity ? capacity : 1;
+    cond_broadcast(&q->consumed);
+    mutex_unlock(&q->lock);
+}
+
+/**
+ * Set function that takes ownership of Requests dropped by queue_pop because
+ * their deadline passed (instead of deleting them).
+ *
+ * The function is called without the queue lock held, so it may use the
+ * queue (or take other locks).
+ *
+ * @param   q           Queue structure.
+ * @param   expire      Function called with each expired Request (NULL to delete them).
+ * @param   arg         Argument passed to function.
+ **/
+void queue_expire(Queue *q, void (*expire)(Request *r, void *arg), void *arg) {
+    if (!q) return;
+
+    mutex_lock(&q->lock);
+    q->expire     = expire;
+    q->expire_arg = arg;
+    mutex_unlock(&q->lock);
 }
 
 /**
- * Push message to the back of queue.
+ * Push message to the back of queue (block while queue is full).
  * @param   q       Queue structure.
  * @param   r       Request structure.
+ * @return  Whether or not queue took ownership of Request (false if shut down).
  **/
-void queue_push(Queue *q, Request *r) {
-    if (!q || !r) return;
+bool queue_push(Queue *q, Request *r) {
+    return queue_push_until(q, r, DEADLINE_NEVER);
+}
 
-    sem_wait(&q->consumed);
+/**
+ * Push message to the back of queue (block while queue is full, at most
+ * until deadline).
+ *
+ * If the Request has a key and a queued Request with the same url and key
+ * has not been popped yet, that Request's body is replaced in place instead
+ * (without blocking), so only the newest value per key is delivered.
+ *
+ * @param   q           Queue structure.
+ * @param   r           Request structure.
+ * @param   deadline    When to give up waiting for room.
+ * @return  Whether or not queue took ownership of Request (false if shut
+ *          down or deadline passed).
+ **/
+bool queue_push_until(Queue *q, Request *r, Deadline deadline) {
+    if (!q || !r) return false;
 
-    sem_wait(&q->lock);
-    if (!q->running) {
-        // If the queue was shut down while we were waiting, we must
-        // release the lock and put the "consumed" ticket back so another
-        // producer can wake up and see that the queue is down.
-        sem_post(&q->consumed);
-        sem_post(&q->lock);
-        return;
+    size_t   bytes  = queue_weight(r);
+    Request *old    = NULL;
+    bool     late   = false;
+    bool     waited = false;    // Whether push blocked (traced as one span)
+
+    mutex_lock(&q->lock);
+    while (q->running && !(r->key && (old = queue_find(q, r))) && queue_full(q, bytes)) {
+        if (!waited) probe_begin(PROBE_QUEUE_PUSH);
+        waited = true;
+        if (deadline_wait(&q->consumed, &q->lock, deadline) == ETIMEDOUT) {
+            late = !(r->key && (old = queue_find(q, r))) && queue_full(q, bytes);
+            break;
+        }
     }
+    if (waited) probe_end(PROBE_QUEUE_PUSH);
 
-    r->next = NULL;
-    if (q->tail) {
-        q->tail->next = r;
-        q->tail = r;
-    } else {
-        q->head = q->tail = r;
+    if (!q->running || late) {
+        mutex_unlock(&q->lock);
+        return false;
+    }
+
+    if (old) {
+        queue_replace(q, old, r);
+        mutex_unlock(&q->lock);
+        return true;
     }
-    q->size++;
 
-    sem_post(&q->lock);
-    sem_post(&q->produced);
+    queue_append(q, r, bytes);
+    mutex_unlock(&q->lock);
+    return true;
 }
 
 /**
  * Pop message from the front of queue (block until there is something to return).
  * @param   q       Queue structure.
- * @param   timeout How long to wait before re-checking condition (ms).
- * @return  Request structure.
+ * @param   timeout Maximum time to wait (ms).
+ * @return  Request structure (NULL on timeout or shutdown).
  **/
 Request * queue_pop(Queue *q, time_t timeout) {
-    struct timespec ts;
-    compute_stoptime(ts, timeout);
+    return queue_pop_until(q, deadline_after(timeout));
+}
+
+/**
+ * Pop message from the front of queue (block until there is something to
+ * return, at most until deadline).
+ *
+ * Requests whose own deadline has passed are dropped instead of returned
+ * (see queue_expire).
+ *
+ * @param   q           Queue structure.
+ * @param   deadline    When to give up waiting.
+ * @return  Request structure (NULL on timeout or shutdown).
+ **/
+Request * queue_pop_until(Queue *q, Deadline deadline) {
+    Request *expired = NULL;
+    Request *value;
+    bool     waited  = false;
 
-    // This loop is only to handle spurious wakeups from signals (EINTR).
-    while (sem_timedwait(&q->produced, &ts) == -1) {
-        if (errno == EINTR) {
-            continue; // Interrupted by a signal, so we try waiting again.
+    mutex_lock(&q->lock);
+    while (!(value = queue_next(q, &expired)) && q->running) {
+        if (!waited) probe_begin(PROBE_QUEUE_POP);
+        waited = true;
+        if (deadline_wait(&q->produced, &q->lock, deadline) == ETIMEDOUT) {
+            value = queue_next(q, &expired);
+            break;
         }
-        return NULL; // A real timeout or error occurred.
     }
+    if (waited) probe_end(PROBE_QUEUE_POP);
+
+    if (value) {
+        queue_shift(q);
+    }
+    mutex_unlock(&q->lock);
 
-    sem_wait(&q->lock);
+    queue_discard(q, expired);
+    return value;
+}
 
-    Request *value = NULL;
-    if (!q->running && q->size == 0) {
-        // This is a shutdown signal. Put the "produced" ticket back
-        // so another consumer can wake up and see the queue is down.
-        sem_post(&q->produced);
-        sem_post(&q->lock);
-        return NULL;
+/**
+ * Wait until queue is below its high watermark (or has drained back to low).
+ * @param   q       Queue structure.
+ * @param   timeout Maximum time to wait (ms).
+ * @return  Whether or not queue accepts pushes without blocking.
+ **/
+bool queue_writable(Queue *q, time_t timeout) {
+    Deadline deadline = deadline_after(timeout);
+
+    mutex_lock(&q->lock);
+    while (q->running && queue_full(q, 0)) {
+        if (deadline_wait(&q->consumed, &q->lock, deadline) == ETIMEDOUT) {
+            break;
+        }
     }
+    bool writable = q->running && !queue_full(q, 0);
+    mutex_unlock(&q->lock);
+    return writable;
+}
 
-    // This is the normal case: pop the message.
-    value = q->head;
-    if (value) {
-        q->head = q->head->next;
-        if (!q->head) {
-            q->tail = NULL;
+/**
+ * Reserve a slot for one Request (wait up to timeout for one to free up).
+ *
+ * A reservation is a credit: its holder may fetch a Request from elsewhere
+ * and then hand it over with queue_commit without blocking, or give the slot
+ * back with queue_release if nothing arrived.
+ *
+ * @param   q       Queue structure.
+ * @param   timeout Maximum time to wait (ms).
+ * @return  Whether or not a slot was reserved.
+ **/
+bool queue_reserve(Queue *q, time_t timeout) {
+    return queue_reserve_until(q, deadline_after(timeout));
+}
+
+/**
+ * Reserve a slot for one Request (wait until deadline for one to free up).
+ * @param   q           Queue structure.
+ * @param   deadline    When to give up waiting.
+ * @return  Whether or not a slot was reserved.
+ **/
+bool queue_reserve_until(Queue *q, Deadline deadline) {
+    bool waited = false;
+
+    mutex_lock(&q->lock);
+    while (q->running && queue_full(q, 0)) {
+        if (!waited) probe_begin(PROBE_QUEUE_RESERVE);
+        waited = true;
+        if (deadline_wait(&q->consumed, &q->lock, deadline) == ETIMEDOUT) {
+            break;
         }
-        q->size--;
-        sem_post(&q->consumed); // Signal that a slot is now free.
-    } else {
-        // This can happen if we are woken up by shutdown.
-        // We must put the "produced" ticket back for the next consumer.
-        sem_post(&q->produced);
     }
+    if (waited) probe_end(PROBE_QUEUE_RESERVE);
+    bool reserved = q->running && !queue_full(q, 0);
+    if (reserved) {
+        q->reserved++;
+    }
+    mutex_unlock(&q->lock);
+    return reserved;
+}
 
-    sem_post(&q->lock);
-    return value;
+/**
+ * Push message into a slot obtained from queue_reserve (never blocks).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not message was queued (false if queue is shut down).
+ **/
+bool queue_commit(Queue *q, Request *r) {
+    if (!q || !r) return false;
+
+    size_t bytes = queue_weight(r);
+
+    mutex_lock(&q->lock);
+    if (q->reserved) {
+        q->reserved--;
+    }
+
+    bool running = q->running;
+    if (running) {
+        queue_append(q, r, bytes);
+    }
+    mutex_unlock(&q->lock);
+    return running;
 }
 
-/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
+/**
+ * Return unused slot obtained from queue_reserve.
+ * @param   q       Queue structure.
+ **/
+void queue_release(Queue *q) {
+    if (!q) return;
 
+    mutex_lock(&q->lock);
+    if (q->reserved) {
+        q->reserved--;
+    }
+    cond_broadcast(&q->consumed);
+    mutex_unlock(&q->lock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
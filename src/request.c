@@ -1,23 +1,36 @@
 /* Request.c: Request structure */
 
+#include "smq/probe.h"
 #include "smq/request.h"
+#include "smq/thread.h"
+#include "smq/transport.h"
 #include "smq/utils.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 #include <curl/curl.h>
 
+/* Constants */
+
+#define HTTP_CONNECTIONS_MAX    (256)   // Idle connections kept by each thread's handle
+#define RESPONSE_CHUNK          (4096)  // Smallest response buffer
+#define RESPONSE_PRESIZE_MAX    (64<<20)// Largest Content-Length trusted up front
+
 /* Internal Structures */
 
 typedef struct {
     char *       data;      // Response data string
     size_t       size;      // Response data length
+    size_t       capacity;  // Allocated bytes of data
+    void *       curl;      // curl handle receiving response
 } Response;
 
 typedef struct {
     const char * data;      // Payload data string
+    size_t       length;    // Payload data length
     size_t       offset;    // Payload data offset
 } Payload;
 
@@ -26,6 +39,11 @@ typedef struct {
 /**
  * Writer function: Copy data up to size*nmemb from ptr to userdata (Response).
  *
+ * The buffer is sized from Content-Length on the first chunk (so a typical
+ * response is allocated once and never copied), and otherwise grows
+ * geometrically, so a large body is copied O(log n) times rather than once
+ * per chunk.
+ *
  * @param   ptr         Pointer to delivered data.
  * @param   size        Always 1.
  * @param   nmemb       Size of the delivered data.
@@ -33,18 +51,71 @@ typedef struct {
  **/
 size_t  request_writer(char *ptr, size_t size, size_t nmemb, void *userdata) {
     Response *response = userdata;
-    size_t capacity = nmemb * size;
-    char *data = realloc(response->data, response->size + capacity + 1);
-    if (!data) {
-        return 0;
+    size_t length = nmemb * size;
+    size_t needed = response->size + length + 1;
+
+    if (needed > response->capacity) {
+        size_t capacity = response->capacity ? response->capacity * 2 : RESPONSE_CHUNK;
+
+        curl_off_t expected = -1;
+        if (!response->capacity && response->curl &&
+            curl_easy_getinfo(response->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &expected) == CURLE_OK &&
+            expected > 0 && expected < RESPONSE_PRESIZE_MAX) {
+            capacity = (size_t)expected + 1;
+        }
+        if (capacity < needed) {
+            capacity = needed;
+        }
+
+        probe_begin(PROBE_WRITER);
+        char *data = realloc(response->data, capacity);
+        probe_end(PROBE_WRITER);
+        if (!data) {
+            return 0;
+        }
+        response->data     = data;
+        response->capacity = capacity;
+    }
+
+    memcpy(response->data + response->size, ptr, length);
+    response->size += length;
+    response->data[response->size] = '\0';
+
+    return length;
+}
+
+/**
+ * Header function: Parse trace, message id, and TTL headers into userdata (Request).
+ *
+ * @param   buffer      Pointer to header line (not NUL terminated).
+ * @param   size        Always 1.
+ * @param   nitems      Size of the header line.
+ * @param   userdata    Pointer to user-provided Request structure.
+ **/
+size_t request_header(char *buffer, size_t size, size_t nitems, void *userdata) {
+    Request *r      = userdata;
+    size_t   length = size * nitems;
+    size_t   prefix = strlen(TRACE_HEADER ":");
+    char     value[BUFSIZ];
+
+    if (length > prefix && length - prefix < sizeof(value) &&
+        strncasecmp(buffer, TRACE_HEADER ":", prefix) == 0) {
+        memcpy(value, buffer + prefix, length - prefix);
+        value[length - prefix] = 0;
+        r->trace = trace_parse(r->trace, value + strspn(value, " "));
     }
 
-    memcpy(data + response->size, ptr, capacity);
-    response->size += capacity;
-    data[response->size]='\0';
-    response->data = data;
+    prefix = strlen(MESSAGE_HEADER ":");
+    if (length > prefix && strncasecmp(buffer, MESSAGE_HEADER ":", prefix) == 0) {
+        r->id = strtoull(buffer + prefix, NULL, 10);
+    }
 
-    return capacity;
+    prefix = strlen(TTL_HEADER ":");
+    if (length > prefix && strncasecmp(buffer, TTL_HEADER ":", prefix) == 0) {
+        r->deadline = deadline_after(strtol(buffer + prefix, NULL, 10));
+    }
+
+    return length;
 }
 
 /**
@@ -61,10 +132,9 @@ size_t request_reader(char *ptr, size_t size, size_t nmemb, void *userdata) {
 
     if (!payload || !payload->data) return 0;
 
-    size_t total = strlen(payload->data);
     size_t remaining;
-    if (total > payload->offset) {
-        remaining = total - payload->offset;
+    if (payload->length > payload->offset) {
+        remaining = payload->length - payload->offset;
     } else {
         remaining = 0;
     }
@@ -96,7 +166,10 @@ Request * request_create(const char *method, const char *url, const char *body)
     if (r) {
         if (method) r->method = strdup(method);
         if (url)    r->url    = strdup(url);
-        if (body)   r->body   = strdup(body);
+        if (body) {
+            r->length = strlen(body);
+            if ((r->body = malloc(r->length + 1))) memcpy(r->body, body, r->length + 1);
+        }
     }
 
     return r;
@@ -111,84 +184,222 @@ void request_delete(Request *r) {
         free(r->method);
         free(r->url);
         free(r->body);
+        free(r->trace);
+        free(r->key);
         free(r);
     }
 }
 
+/**
+ * Perform request using the Transport registered for the URL scheme.
+ * @param   r           Request structure.
+ * @param   timeout     Maximum total transaction time (in milliseconds).
+ * @return  Body of response (NULL if error or timeout, with offline set
+ *          if the broker itself could not be reached, and received set to
+ *          its length otherwise).
+ **/
+char * request_perform(Request *r, long timeout) {
+    if (!r || !r->method || !r->url) return NULL;
+
+    const Transport *transport = transport_lookup(r->url);
+    if (!transport) {
+        error("Unsupported URL: %s", r->url);
+        return NULL;
+    }
+
+    r->offline = false;
+
+    // Never let a Request outlive the deadline of whoever is waiting on it
+    if (r->deadline) {
+        if (deadline_expired(r->deadline)) return NULL;
+        timeout = min(timeout, deadline_remaining(r->deadline));
+    }
+
+    // Transports that know the length of the response set it themselves
+    r->received = 0;
+    char *response = transport->perform(r, timeout);
+    if (response && !r->received) {
+        r->received = strlen(response);
+    }
+    return response;
+}
+
+/* HTTP Transport */
+
+static CURLSH *         HTTPShare = NULL;
+static Mutex            HTTPShareLocks[CURL_LOCK_DATA_LAST];
+static pthread_key_t    HTTPHandleKey;
+static pthread_once_t   HTTPOnce = PTHREAD_ONCE_INIT;
+
+static void http_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)curl; (void)access; (void)userptr;
+    mutex_lock(&HTTPShareLocks[data]);
+}
+
+static void http_share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+    (void)curl; (void)userptr;
+    mutex_unlock(&HTTPShareLocks[data]);
+}
+
+static void http_handle_delete(void *curl) {
+    curl_easy_cleanup(curl);
+}
+
+/**
+ * Initialize libcurl along with the DNS cache shared by every thread.
+ *
+ * Connections are not shared: libcurl does not support using one connection
+ * cache from concurrent threads, so each thread's handle keeps its own.
+ **/
+static void http_init() {
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (size_t i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        mutex_init(&HTTPShareLocks[i], NULL);
+    }
+
+    if ((HTTPShare = curl_share_init())) {
+        curl_share_setopt(HTTPShare, CURLSHOPT_LOCKFUNC, http_share_lock);
+        curl_share_setopt(HTTPShare, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+        curl_share_setopt(HTTPShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+
+    pthread_key_create(&HTTPHandleKey, http_handle_delete);
+}
+
+/**
+ * Return this thread's curl handle (reset to defaults), creating it on first use.
+ *
+ * Keeping one handle per thread preserves its live connections, so requests
+ * reuse keep-alive (or HTTP/2) connections instead of reconnecting each time.
+ *
+ * @return  curl handle owned by the calling thread (NULL on error).
+ **/
+static CURL * http_handle() {
+    pthread_once(&HTTPOnce, http_init);
+
+    CURL *curl = pthread_getspecific(HTTPHandleKey);
+    if (curl) {
+        curl_easy_reset(curl);
+    } else if ((curl = curl_easy_init())) {
+        pthread_setspecific(HTTPHandleKey, curl);
+    } else {
+        return NULL;
+    }
+
+    if (HTTPShare) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, HTTPShare);
+    }
+
+    // Keep a connection to every broker (the default of 5 makes clustered
+    // clients reconnect)
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long)HTTP_CONNECTIONS_MAX);
+    return curl;
+}
+
 /**
  * Perform HTTP request using libcurl.
  *
- *  1. Initialize curl.
+ *  1. Acquire thread's curl handle.
  *  2. Set curl options.
  *  3. Perform curl.
- *  4. Cleanup curl.
  *
  * Note: this must support GET, PUT, and DELETE methods, and adjust options as
  * necessary to support these methods.
  *
  * @param   r           Request structure.
  * @param   timeout     Maximum total HTTP transaction time (in milliseconds).
+ * @param   version     HTTP version to use (ie. CURL_HTTP_VERSION_NONE).
  * @return  Body of HTTP response (NULL if error or timeout).
  **/
-char * request_perform(Request *r, long timeout) {
-
-    CURL *curl = curl_easy_init();
+static char * http_request(Request *r, long timeout, long version) {
+    CURL *curl = http_handle();
 
     if (!curl) {
         fprintf(stderr, "Initialization failed\n");
         return NULL;
     }
 
-    Response response = (Response){0};
+    // h2c:// URLs are plain http:// URLs spoken with HTTP/2 prior knowledge
+    char *url = NULL;
+    if (strncmp(r->url, H2CTransport.scheme, strlen(H2CTransport.scheme)) == 0) {
+        const char *rest = r->url + strlen(H2CTransport.scheme);
+        if (!(url = malloc(strlen(HTTPTransport.scheme) + strlen(rest) + 1))) {
+            return NULL;
+        }
+        sprintf(url, "%s%s", HTTPTransport.scheme, rest);
+    }
+
+    Response response = (Response){ .curl = curl };
+    Payload  payload  = (Payload){0};   // Must outlive curl_easy_perform
+
+    curl_easy_setopt(curl, CURLOPT_URL, url ? url : r->url);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, version);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, request_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, r);
+
+    // Propagate trace (if sampled) so broker and consumer can extend it
+    struct curl_slist *headers = NULL;
+    char header[BUFSIZ];
+    if (r->trace) {
+        char stamps[BUFSIZ];
+        snprintf(header, sizeof(header), "%s: %s", TRACE_HEADER, trace_format(r->trace, stamps, sizeof(stamps)));
+        headers = curl_slist_append(headers, header);
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, r->url);
+    // Tell the broker how long a published message has left to live
+    if (r->deadline && strcmp(r->method, "PUT") == 0) {
+        snprintf(header, sizeof(header), "%s: %ld", TTL_HEADER, deadline_remaining(r->deadline));
+        headers = curl_slist_append(headers, header);
+    }
+    if (headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, request_writer);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, r->connect ? r->connect : timeout);
 
     if (strcmp(r->method, "GET") == 0) {
         // do nothing
     } else if (strcmp(r->method, "PUT") == 0) {
-        Payload payload;
-        payload.data = NULL;
-        payload.offset = 0;
-
-        size_t payloadDataLength;
-        if (r->body) {
-            payload.data = r->body;
-            payloadDataLength = strlen(r->body);
-        } else {
-            payload.data = "";
-            payloadDataLength = 0;
-        }
-
-        payload.offset = 0;
-
-        size_t body_len = payloadDataLength;
+        payload.data   = r->body ? r->body : "";
+        payload.length = strlen(payload.data);
 
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
         curl_easy_setopt(curl, CURLOPT_READFUNCTION, request_reader);
         curl_easy_setopt(curl, CURLOPT_READDATA, &payload);
-        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)body_len);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)payload.length);
 
     } else if (strcmp(r->method, "DELETE") == 0) {
         curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
     } else {
-        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
         free(response.data);
+        free(url);
         return NULL;
     }
 
+    probe_begin(PROBE_CURL);
     CURLcode result = curl_easy_perform(curl);
+    probe_end(PROBE_CURL);
 
     long http_code = 0;
     if (result == CURLE_OK) {
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
     }
 
-    curl_easy_cleanup(curl);
+    // A transfer that times out after the request went out is a long poll
+    // that found nothing (the broker is alive); any other error, or a 5xx,
+    // means the broker could not be reached
+    long sent = 0;
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &sent);
+    r->offline = (result != CURLE_OK && !(result == CURLE_OPERATION_TIMEDOUT && sent > 0)) ||
+                 http_code >= 500;
+
+    curl_slist_free_all(headers);
+    free(url);
 
     if (result != CURLE_OK) {
         free(response.data);
@@ -200,7 +411,19 @@ char * request_perform(Request *r, long timeout) {
         return NULL;
     }
 
+    r->received = response.size;
     return response.data;
 }
 
+static char * http_perform(Request *r, long timeout) {
+    return http_request(r, timeout, CURL_HTTP_VERSION_NONE);
+}
+
+static char * h2c_perform(Request *r, long timeout) {
+    return http_request(r, timeout, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+}
+
+const Transport HTTPTransport = {"http://", http_perform};
+const Transport H2CTransport  = {"h2c://",  h2c_perform};
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,512 @@
+/* shm.c: SMQ Shared-Memory Transport */
+
+#include "smq/deadline.h"
+#include "smq/transport.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* Constants */
+
+#define SHM_MAGIC       (0x32514d53)    // "SMQ2"
+#define SHM_MAILBOXES   (32)            // Maximum queues per segment
+#define SHM_TOPICS      (16)            // Maximum topics per queue
+#define SHM_NAME        (1<<7)          // Maximum queue or topic name length
+#define SHM_RING        (1<<20)         // Ring buffer bytes per queue
+#define SHM_WRAP        (UINT32_MAX)    // Record length marking wrap to start of ring
+
+#define SHM_RECORD(length)  ((sizeof(SHMRecord) + (length) + 7) & ~7UL)   // Ring bytes taken by record
+
+/* Internal Structures */
+
+typedef struct {
+    uint32_t        length;                         // Body length (SHM_WRAP marks wrap to start of ring)
+    uint32_t        reserved;
+    uint64_t        deadline;                       // When message expires (CLOCK_MONOTONIC ns, 0 for never)
+} SHMRecord;                                        // ... followed by body
+
+typedef struct {
+    char            name[SHM_NAME];                 // Name of message queue
+    char            topics[SHM_TOPICS][SHM_NAME];   // Topics queue is subscribed to
+    uint64_t        head;                           // Ring read position (bytes)
+    uint64_t        tail;                           // Ring write position (bytes)
+    uint32_t        produced;                       // Futex word bumped on publish
+    uint32_t        consumed;                       // Futex word bumped on retrieve
+    uint32_t        waiters;                        // Number of processes waiting on futexes
+    char            ring[SHM_RING];                 // Variable-length message records
+} SHMMailbox;
+
+typedef struct {
+    uint32_t        magic;                          // Set once segment is initialized
+    pthread_mutex_t lock;                           // Process-shared lock for mailboxes
+    SHMMailbox      mailboxes[SHM_MAILBOXES];       // Message queues in segment
+} SHMSegment;
+
+typedef struct Mapping Mapping;
+struct Mapping {
+    char            name[SHM_NAME];                 // Name of segment
+    SHMSegment     *segment;                        // Mapped segment
+    Mapping        *next;                           // Pointer to next Mapping in sequence
+};
+
+/* Globals */
+
+static Mapping *Mappings = NULL;
+static Mutex    MappingsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Internal Functions */
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * Wait on futex word until it changes from seen or the deadline passes.
+ * @param   word        Futex word in shared memory.
+ * @param   seen        Value of word observed while holding segment lock.
+ * @param   deadline    When to stop waiting.
+ * @return  Whether or not there is time left to wait again.
+ **/
+static bool shm_wait(uint32_t *word, uint32_t seen, Deadline deadline) {
+    long left = deadline_remaining(deadline);
+    if (!left) return false;
+
+    struct timespec timeout = { left / 1000, (left % 1000) * 1000000 };
+    futex(word, FUTEX_WAIT, seen, &timeout);
+    return true;
+}
+
+/**
+ * Wake every process waiting on futex word (skipping syscall if none are).
+ **/
+static void shm_wake(SHMMailbox *m, uint32_t *word) {
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&m->waiters, __ATOMIC_ACQUIRE)) {
+        futex(word, FUTEX_WAKE, INT32_MAX, NULL);
+    }
+}
+
+/**
+ * Lock segment, recovering the lock if its previous owner died.
+ **/
+static void shm_lock(SHMSegment *s) {
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&s->lock);
+    }
+}
+
+static void shm_unlock(SHMSegment *s) {
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Map named segment, creating and initializing it if it does not exist.
+ * @param   name        Name of segment (without leading slash).
+ * @return  Mapped segment (NULL on error).
+ **/
+static SHMSegment * shm_map(const char *name) {
+    char path[SHM_NAME + 8];
+    snprintf(path, sizeof(path), "/smq.%s", name);
+
+    bool created = true;
+    int  fd      = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd      = shm_open(path, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        error("Unable to open shared memory %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (created && ftruncate(fd, sizeof(SHMSegment)) < 0) {
+        error("Unable to size shared memory %s: %s", path, strerror(errno));
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+
+    // Segment may still be empty if another process is creating it
+    struct stat st;
+    while (!created && fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(SHMSegment)) {
+        usleep(1000);
+    }
+
+    SHMSegment *s = mmap(NULL, sizeof(SHMSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        error("Unable to map shared memory %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&s->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&s->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+            usleep(1000);
+        }
+    }
+
+    return s;
+}
+
+/**
+ * Lookup mapping for segment, mapping it on first use by this process.
+ * @param   name        Name of segment.
+ * @return  Mapped segment (NULL on error).
+ **/
+static SHMSegment * shm_segment(const char *name) {
+    SHMSegment *s = NULL;
+
+    mutex_lock(&MappingsLock);
+    for (Mapping *m = Mappings; m; m = m->next) {
+        if (streq(m->name, name)) {
+            s = m->segment;
+            break;
+        }
+    }
+
+    if (!s && (s = shm_map(name))) {
+        Mapping *m = calloc(1, sizeof(Mapping));
+        if (m) {
+            snprintf(m->name, sizeof(m->name), "%s", name);
+            m->segment = s;
+            m->next    = Mappings;
+            Mappings   = m;
+        }
+    }
+    mutex_unlock(&MappingsLock);
+
+    return s;
+}
+
+/**
+ * Find mailbox with specified name (segment lock must be held).
+ * @param   s           Segment structure.
+ * @param   queue       Name of message queue.
+ * @param   create      Whether or not to claim an empty mailbox for queue.
+ * @return  Mailbox structure (NULL if not found or segment is full).
+ **/
+static SHMMailbox * shm_mailbox(SHMSegment *s, const char *queue, bool create) {
+    SHMMailbox *empty = NULL;
+
+    if (strlen(queue) >= SHM_NAME) return NULL;
+
+    for (size_t i = 0; i < SHM_MAILBOXES; i++) {
+        SHMMailbox *m = &s->mailboxes[i];
+        if (streq(m->name, queue)) return m;
+        if (!empty && !m->name[0]) empty = m;
+    }
+
+    if (create && empty) {
+        strcpy(empty->name, queue);
+    }
+    return create ? empty : NULL;
+}
+
+/**
+ * Return topic slot in mailbox (NULL if not subscribed).
+ **/
+static char * shm_topic(SHMMailbox *m, const char *topic) {
+    for (size_t i = 0; i < SHM_TOPICS; i++) {
+        if (m->topics[i][0] && streq(m->topics[i], topic)) {
+            return m->topics[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return whether or not any topic pattern in mailbox matches topic.
+ **/
+static bool shm_matches(SHMMailbox *m, const char *topic) {
+    for (size_t i = 0; i < SHM_TOPICS; i++) {
+        if (m->topics[i][0] && transport_match(m->topics[i], topic)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Append record to mailbox ring (segment lock must be held).
+ * @return  Whether or not there was enough room for the record.
+ **/
+static bool shm_append(SHMMailbox *m, const char *body, uint32_t length, Deadline deadline) {
+    uint64_t record = SHM_RECORD(length);
+    uint64_t offset = m->tail % SHM_RING;
+    uint64_t skip   = (offset + record > SHM_RING) ? SHM_RING - offset : 0;
+
+    if (SHM_RING - (m->tail - m->head) < skip + record) return false;
+
+    if (skip) {
+        *(uint32_t *)(m->ring + offset) = SHM_WRAP;
+        m->tail += skip;
+        offset   = 0;
+    }
+
+    // CLOCK_MONOTONIC is system-wide, so every process agrees on deadline
+    *(SHMRecord *)(m->ring + offset) = (SHMRecord){ .length = length, .deadline = deadline };
+    memcpy(m->ring + offset + sizeof(SHMRecord), body, length);
+    m->tail += record;
+    return true;
+}
+
+/**
+ * Remove oldest unexpired record from mailbox ring, skipping (and freeing
+ * the room of) expired ones on the way (segment lock must be held).
+ * @return  Newly allocated message body (NULL if ring is empty).
+ **/
+static char * shm_remove(SHMMailbox *m, Deadline *deadline) {
+    Deadline now = 0;
+
+    while (m->head != m->tail) {
+        uint64_t   offset = m->head % SHM_RING;
+        SHMRecord *record = (SHMRecord *)(m->ring + offset);
+        if (record->length == SHM_WRAP) {
+            m->head += SHM_RING - offset;
+            record   = (SHMRecord *)m->ring;
+        }
+
+        uint32_t length = record->length;
+        if (record->deadline) {
+            if (!now) now = deadline_after(0);
+            if (record->deadline <= now) {
+                m->head += SHM_RECORD(length);
+                continue;
+            }
+        }
+
+        char *body = malloc(length + 1);
+        if (!body) return NULL;
+
+        memcpy(body, (char *)record + sizeof(SHMRecord), length);
+        body[length] = 0;
+        *deadline = record->deadline;
+        m->head  += SHM_RECORD(length);
+        return body;
+    }
+
+    return NULL;
+}
+
+/**
+ * Publish message to every subscribed mailbox, waiting for room if necessary.
+ *
+ * A message too large to ever fit in a ring (over half of it, so that a
+ * record never has to wait for one that wraps) is refused at once, rather
+ * than after waiting out timeout for room that never comes.
+ *
+ * @param   s           Segment structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body.
+ * @param   expires     When message expires (0 for never).
+ * @param   timeout     Maximum time to wait for room (milliseconds).
+ * @param   dropped     Number of subscribers whose mailbox stayed full.
+ * @return  Number of subscribers that received message.
+ **/
+static size_t shm_publish(SHMSegment *s, const char *topic, const char *body, Deadline expires, long timeout,
+                          size_t *dropped) {
+    Deadline deadline    = deadline_after(timeout);
+    size_t   length      = strlen(body);
+    size_t   subscribers = 0;
+    uint32_t delivered   = 0;   // Bitmask of mailboxes already written
+
+    *dropped = 0;
+    if (length > UINT32_MAX || SHM_RECORD(length) > SHM_RING / 2) {
+        error("Message (%lu bytes) is too large for shared memory queues", length);
+        return 0;
+    }
+
+    while (true) {
+        SHMMailbox *full = NULL;
+        uint32_t    seen = 0;
+
+        *dropped = 0;
+        shm_lock(s);
+        for (size_t i = 0; i < SHM_MAILBOXES; i++) {
+            SHMMailbox *m = &s->mailboxes[i];
+            if ((delivered & (1U << i)) || !m->name[0] || !shm_matches(m, topic)) {
+                continue;
+            }
+
+            if (shm_append(m, body, length, expires)) {
+                delivered |= 1U << i;
+                subscribers++;
+                shm_wake(m, &m->produced);
+            } else {
+                (*dropped)++;
+                if (!full) {
+                    full = m;
+                    seen = __atomic_load_n(&m->consumed, __ATOMIC_ACQUIRE);
+                }
+            }
+        }
+        if (full) __atomic_add_fetch(&full->waiters, 1, __ATOMIC_ACQ_REL);
+        shm_unlock(s);
+
+        if (!full) break;
+
+        bool again = shm_wait(&full->consumed, seen, deadline);
+        __atomic_sub_fetch(&full->waiters, 1, __ATOMIC_ACQ_REL);
+        if (!again) break;
+    }
+
+    if (*dropped) {
+        error("Dropped message to %s for %lu full shared memory queues", topic, *dropped);
+    }
+    return subscribers;
+}
+
+/**
+ * Retrieve one message from mailbox (wait up to timeout for one to arrive).
+ * @return  Newly allocated message body (NULL if none arrived).
+ **/
+static char * shm_retrieve(SHMSegment *s, const char *queue, Deadline *expires, long timeout) {
+    Deadline deadline = deadline_after(timeout);
+
+    while (true) {
+        shm_lock(s);
+        SHMMailbox *m = shm_mailbox(s, queue, true);
+        if (!m) {
+            shm_unlock(s);
+            return NULL;
+        }
+
+        uint64_t head = m->head;
+        char    *body = shm_remove(m, expires);
+        if (m->head != head) {
+            shm_wake(m, &m->consumed);
+        }
+        if (body) {
+            shm_unlock(s);
+            return body;
+        }
+
+        uint32_t seen = __atomic_load_n(&m->produced, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&m->waiters, 1, __ATOMIC_ACQ_REL);
+        shm_unlock(s);
+
+        bool again = shm_wait(&m->produced, seen, deadline);
+        __atomic_sub_fetch(&m->waiters, 1, __ATOMIC_ACQ_REL);
+        if (!again) return NULL;
+    }
+}
+
+/**
+ * Subscribe or unsubscribe mailbox to topic.
+ * @return  Whether or not the subscription changed as requested.
+ **/
+static bool shm_subscription(SHMSegment *s, const char *queue, const char *topic, bool subscribe) {
+    if (strlen(topic) >= SHM_NAME) return false;
+
+    bool result = false;
+    shm_lock(s);
+    SHMMailbox *m = shm_mailbox(s, queue, subscribe);
+    if (m) {
+        char *slot = shm_topic(m, topic);
+        if (subscribe) {
+            for (size_t i = 0; i < SHM_TOPICS && !slot; i++) {
+                if (!m->topics[i][0]) {
+                    slot = strcpy(m->topics[i], topic);
+                }
+            }
+            result = slot != NULL;
+        } else if (slot) {
+            slot[0] = 0;
+            result  = true;
+        }
+    }
+    shm_unlock(s);
+    return result;
+}
+
+/* SHM Transport */
+
+/**
+ * Perform Request against shared-memory segment named by URL:
+ *
+ *  smq://shm/$segment/...  (same REST API as the HTTP broker)
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Maximum time to wait (milliseconds).
+ * @return  Newly allocated response body (NULL if error or timeout).
+ **/
+static char * shm_perform(Request *r, long timeout) {
+    const char *name = r->url + strlen(SHMTransport.scheme);
+    const char *path = strchr(name, '/');
+    if (!path || path == name || (size_t)(path - name) >= SHM_NAME) return NULL;
+
+    char segment_name[SHM_NAME] = {0};
+    strncpy(segment_name, name, path - name);
+
+    SHMSegment *s = shm_segment(segment_name);
+    if (!s) return NULL;
+
+    char *queue    = NULL;
+    char *topic    = NULL;
+    char *response = NULL;
+    const char *body = r->body ? r->body : "";
+    size_t subscribers;
+    size_t dropped;
+
+    switch (transport_route(r->method, path, &queue, &topic)) {
+        case ROUTE_PUBLISH:
+            // As with the local broker, only a publish that reached no
+            // mailbox fails (so a retry does not duplicate it for the others)
+            if ((subscribers = shm_publish(s, topic, body, r->deadline, timeout, &dropped))) {
+                response = transport_response("Published message (%lu bytes) to %lu subscribers of %s (%lu full)\n",
+                    strlen(body), subscribers, topic, dropped);
+            }
+            break;
+        case ROUTE_RETRIEVE:
+            response = shm_retrieve(s, queue, &r->deadline, min(timeout, transport_query(path, "wait", timeout)));
+            break;
+        case ROUTE_SUBSCRIBE:
+            if (shm_subscription(s, queue, topic, true)) {
+                response = transport_response("Subscribed queue (%s) to topic (%s)\n", queue, topic);
+            }
+            break;
+        case ROUTE_UNSUBSCRIBE:
+            if (shm_subscription(s, queue, topic, false)) {
+                response = transport_response("Unsubscribed queue (%s) from topic (%s)\n", queue, topic);
+            }
+            break;
+        case ROUTE_ACK:
+        case ROUTE_NACK:
+            // Messages are handed over in-process without leases, so there is
+            // nothing to settle
+            response = transport_response("Acknowledged 0 messages from queue (%s)\n", queue);
+            break;
+        case ROUTE_HEALTH:
+            response = transport_response("OK\n");
+            break;
+        default:
+            break;
+    }
+
+    free(queue);
+    free(topic);
+    return response;
+}
+
+const Transport SHMTransport = {"smq://shm/", shm_perform};
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
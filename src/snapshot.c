@@ -0,0 +1,346 @@
+/* snapshot.c: SMQ Snapshot and Restore of Pending Messages */
+
+#include "smq/client.h"
+#include "smq/queue.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define SNAPSHOT_MAGIC      "SMQS"
+#define SNAPSHOT_VERSION    (3)
+
+/* Internal Structures */
+
+typedef struct {
+    char     magic[4];          // SNAPSHOT_MAGIC
+    uint32_t version;           // SNAPSHOT_VERSION
+    uint64_t count;             // Number of records
+    int64_t  created;           // When snapshot was written (CLOCK_REALTIME ms)
+} SnapshotHeader;
+
+typedef struct {
+    uint8_t  queue;             // SNAPSHOT_OUTGOING, SNAPSHOT_INCOMING, or SNAPSHOT_SCHEDULED
+    uint8_t  keyed;             // Whether record carries a conflation key
+    uint16_t reserved;
+    uint32_t lengths[5];        // Lengths of method, url, body, key, and queue name
+    int64_t  remaining;         // Time left before deadline in ms (-1 for none)
+    int64_t  due;               // Time left before scheduled send in ms (-1 if not scheduled)
+} SnapshotRecord;               // ... followed by the NUL terminated strings
+
+enum {
+    SNAPSHOT_OUTGOING,
+    SNAPSHOT_INCOMING,
+    SNAPSHOT_SCHEDULED,
+};
+
+/* Internal Functions */
+
+static int64_t snapshot_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Append Request as record to snapshot stream.
+ * @param   name    Name of attached queue Request is waiting in (NULL for the client's own).
+ * @return  Whether or not record was written.
+ **/
+static bool snapshot_write(FILE *stream, Request *r, uint8_t queue, const char *name) {
+    const char *strings[5] = { r->method, r->url, r->body, r->key, name };
+    SnapshotRecord record  = {
+        .queue     = queue,
+        .keyed     = r->key != NULL,
+        .remaining = r->deadline ? deadline_remaining(r->deadline) : -1,
+        .due       = r->due ? deadline_remaining(r->due) : -1,
+    };
+
+    for (size_t i = 0; i < 5; i++) {
+        record.lengths[i] = strings[i] ? strlen(strings[i]) : 0;
+    }
+
+    if (fwrite(&record, sizeof(record), 1, stream) != 1) return false;
+    for (size_t i = 0; i < 5; i++) {
+        if (fwrite(strings[i] ? strings[i] : "", record.lengths[i] + 1, 1, stream) != 1) return false;
+    }
+    return true;
+}
+
+/**
+ * Write every Request of queue list that is worth restoring.
+ *
+ * Settlement flushes are skipped (their leases simply expire), and so are
+ * leased incoming messages, since the broker redelivers those itself.
+ *
+ * @return  Number of records written (-1 on error).
+ **/
+static ssize_t snapshot_list(FILE *stream, Request *head, uint8_t queue, const char *name) {
+    ssize_t count = 0;
+
+    for (Request *r = head; r; r = r->next) {
+        if (queue != SNAPSHOT_INCOMING && (streq(r->method, "ACK") || streq(r->method, "NACK"))) continue;
+        if (queue == SNAPSHOT_INCOMING && r->id) continue;
+
+        if (!snapshot_write(stream, r, queue, name)) return -1;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Find incoming queue of attached queue, attaching it (not merged) if the
+ * client has not done so yet, so its restored messages wait for
+ * smq_retrieve_from as they did before.
+ * @return  Incoming queue of attached queue (NULL on failure).
+ **/
+static Queue * snapshot_queue(SMQ *smq, const char *name) {
+    Queue *incoming = NULL;
+
+    for (int attempt = 0; attempt < 2 && !incoming; attempt++) {
+        if (attempt && !smq_attach(smq, name, 1, false)) break;
+
+        mutex_lock(&smq->lock);
+        for (SMQQueue *q = smq->queues; q && !incoming; q = q->next) {
+            if (streq(q->name, name)) incoming = q->incoming;
+        }
+        mutex_unlock(&smq->lock);
+    }
+
+    return incoming;
+}
+
+/* Functions */
+
+/**
+ * Save messages still waiting in the client to file, so that a restarted
+ * client (created with SMQConfig.snapshot) resumes where this one stopped.
+ *
+ * The client is shut down first (if it is still running), so nothing in the
+ * snapshot can also have been sent or retrieved.  The file is written next
+ * to path and renamed over it, so a crash never leaves a partial snapshot.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   path    Path of snapshot file.
+ * @return  Whether or not snapshot was written.
+ **/
+bool smq_snapshot(SMQ *smq, const char *path) {
+    if (!smq || !path) return false;
+    if (smq->running) smq_shutdown(smq);
+
+    char temporary[strlen(path) + 8];
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+
+    int fd = mkstemp(temporary);
+    FILE *stream = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!stream) {
+        error("Unable to create snapshot %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    SnapshotHeader header = { .version = SNAPSHOT_VERSION, .created = snapshot_clock() };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    ssize_t unsent    = -1;
+    ssize_t outgoing  = -1;
+    ssize_t incoming  = -1;
+    ssize_t scheduled = -1;
+    bool    written  = fwrite(&header, sizeof(header), 1, stream) == 1;
+
+    // Requests the pusher was retrying at shutdown were at the front of line
+    if (written) {
+        mutex_lock(&smq->lock);
+        unsent = snapshot_list(stream, smq->unsent, SNAPSHOT_OUTGOING, NULL);
+        mutex_unlock(&smq->lock);
+    }
+    if (unsent >= 0) {
+        mutex_lock(&smq->outgoing->lock);
+        outgoing = snapshot_list(stream, smq->outgoing->head, SNAPSHOT_OUTGOING, NULL);
+        mutex_unlock(&smq->outgoing->lock);
+    }
+    for (size_t i = 1; i < smq->nlanes && outgoing >= 0; i++) {
+        mutex_lock(&smq->lanes[i]->lock);
+        ssize_t count = snapshot_list(stream, smq->lanes[i]->head, SNAPSHOT_OUTGOING, NULL);
+        mutex_unlock(&smq->lanes[i]->lock);
+        outgoing = count < 0 ? -1 : outgoing + count;
+    }
+    if (outgoing >= 0) {
+        mutex_lock(&smq->incoming->lock);
+        incoming = snapshot_list(stream, smq->incoming->head, SNAPSHOT_INCOMING, NULL);
+        mutex_unlock(&smq->incoming->lock);
+    }
+    // Queues attached without merging keep their messages apart
+    if (incoming >= 0) {
+        mutex_lock(&smq->lock);
+        for (SMQQueue *q = smq->queues; q && incoming >= 0; q = q->next) {
+            if (q->incoming == smq->incoming) continue;
+            mutex_lock(&q->incoming->lock);
+            ssize_t count = snapshot_list(stream, q->incoming->head, SNAPSHOT_INCOMING, q->name);
+            mutex_unlock(&q->incoming->lock);
+            incoming = count < 0 ? -1 : incoming + count;
+        }
+        mutex_unlock(&smq->lock);
+    }
+
+    if (incoming >= 0) {
+        mutex_lock(&smq->scheduled->lock);
+        scheduled = 0;
+        for (size_t level = 0; level < WHEEL_LEVELS && scheduled >= 0; level++) {
+            for (size_t i = 0; i < WHEEL_SLOTS && scheduled >= 0; i++) {
+                ssize_t count = snapshot_list(stream, smq->scheduled->slots[level][i].head, SNAPSHOT_SCHEDULED, NULL);
+                scheduled = count < 0 ? -1 : scheduled + count;
+            }
+        }
+        mutex_unlock(&smq->scheduled->lock);
+    }
+
+    written = scheduled >= 0;
+    if (written) {
+        header.count = unsent + outgoing + incoming + scheduled;
+        written = fseek(stream, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, stream) == 1;
+    }
+    written = fflush(stream) == 0 && fsync(fd) == 0 && written;
+    written = fclose(stream) == 0 && written;
+
+    if (!written || rename(temporary, path) < 0) {
+        error("Unable to write snapshot %s: %s", path, strerror(errno));
+        unlink(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Load messages saved by smq_snapshot back into the client's queues.
+ *
+ * The file is mapped rather than read, and removed once loaded so that the
+ * same messages are not restored twice.  Messages whose deadline passed
+ * while the client was down are dropped, and scheduled messages that came
+ * due meanwhile are sent right away.  Messages of queues attached without
+ * merging go back to those queues (attaching them if need be).  If any
+ * other message could not be restored (the file is truncated or a queue
+ * overflowed), the file is kept as path.incomplete instead, so what was not
+ * restored is not lost.
+ *
+ * @param   smq     Simple Request Queue structure.
+ * @param   path    Path of snapshot file.
+ * @return  Number of messages restored (-1 if file is invalid).
+ **/
+ssize_t smq_restore(SMQ *smq, const char *path) {
+    if (!smq || !path) return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;  // Nothing to restore
+        error("Unable to open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        error("Invalid snapshot %s", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char  *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error("Unable to map snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != SNAPSHOT_VERSION) {
+        error("Invalid snapshot %s", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    int64_t elapsed  = snapshot_clock() - header->created;
+    ssize_t restored = 0;
+    size_t  expired  = 0;
+    size_t  offset   = sizeof(SnapshotHeader);
+
+    for (uint64_t n = 0; n < header->count; n++) {
+        SnapshotRecord record;
+        if (size - offset < sizeof(record)) break;
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+
+        const char *strings[5];
+        size_t i;
+        for (i = 0; i < 5; i++) {
+            if (size - offset < (size_t)record.lengths[i] + 1 || data[offset + record.lengths[i]]) break;
+            strings[i] = data + offset;
+            offset    += record.lengths[i] + 1;
+        }
+        if (i < 5) break;
+
+        if (record.remaining >= 0 && record.remaining <= elapsed) {
+            expired++;
+            continue;
+        }
+
+        Request *r = request_create(record.lengths[0] ? strings[0] : NULL,
+                                    record.lengths[1] ? strings[1] : NULL, strings[2]);
+        if (!r) continue;
+        if (record.keyed) {
+            r->key = strdup(strings[3]);
+        }
+        if (record.remaining >= 0) {
+            r->deadline = deadline_after(record.remaining - elapsed);
+        }
+
+        // Outgoing may wait for the pushers, but incoming must not block
+        // creation (it only overflows if capacity shrank since snapshot)
+        bool queued;
+        if (record.queue == SNAPSHOT_SCHEDULED) {
+            queued = smq_schedule(smq, r, deadline_after(record.due > elapsed ? record.due - elapsed : 0));
+        } else if (record.queue == SNAPSHOT_INCOMING) {
+            Queue *incoming = record.lengths[4] ? snapshot_queue(smq, strings[4]) : smq->incoming;
+            queued = incoming && queue_push_until(incoming, r, deadline_after(0));
+        } else {
+            queued = queue_push(smq_outgoing(smq, r), r);
+        }
+        if (!queued) {
+            request_delete(r);
+            continue;
+        }
+        restored++;
+    }
+
+    uint64_t count = header->count;
+    munmap(data, size);
+
+    if (restored + expired < count) {
+        char incomplete[strlen(path) + sizeof(".incomplete")];
+        snprintf(incomplete, sizeof(incomplete), "%s.incomplete", path);
+        error("Restored %ld of %lu messages (%lu expired) from snapshot %s, keeping it as %s",
+            restored, count, expired, path, incomplete);
+        if (rename(path, incomplete) < 0) {
+            error("Unable to rename snapshot %s: %s", path, strerror(errno));
+        }
+        return restored;
+    }
+
+    if (restored < (ssize_t)count) {
+        info("Restored %ld of %lu messages (%lu expired) from snapshot %s", restored, count, expired, path);
+    }
+    unlink(path);
+    return restored;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
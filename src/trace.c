@@ -0,0 +1,150 @@
+/* trace.c: SMQ Per-Message Latency Tracing */
+
+#include "smq/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Functions */
+
+/**
+ * Return current CLOCK_MONOTONIC time in nanoseconds.
+ **/
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Create Trace structure with no stamps.
+ * @return  Newly allocated Trace structure.
+ **/
+Trace * trace_create() {
+    return calloc(1, sizeof(Trace));
+}
+
+/**
+ * Copy Trace structure.
+ * @param   t           Trace structure (may be NULL).
+ * @return  Newly allocated copy of Trace (NULL if t is NULL).
+ **/
+Trace * trace_copy(const Trace *t) {
+    Trace *copy = t ? malloc(sizeof(Trace)) : NULL;
+    if (copy) {
+        memcpy(copy, t, sizeof(Trace));
+    }
+    return copy;
+}
+
+/**
+ * Record current time as the specified stage.
+ * @param   t           Trace structure (ignored if NULL).
+ * @param   stage       Stage reached.
+ **/
+void trace_stamp(Trace *t, TraceStage stage) {
+    if (t) {
+        t->stamps[stage] = trace_now();
+    }
+}
+
+/**
+ * Format Trace as comma-separated stamps for the trace header.
+ * @param   t           Trace structure.
+ * @param   buffer      Buffer to store formatted string.
+ * @param   size        Size of buffer.
+ * @return  Formatted string in buffer.
+ **/
+char * trace_format(const Trace *t, char *buffer, size_t size) {
+    size_t length = 0;
+
+    buffer[0] = 0;
+    for (size_t s = 0; s < TRACE_STAGES && length < size; s++) {
+        length += snprintf(buffer + length, size - length, "%s%lu", s ? "," : "", t->stamps[s]);
+    }
+
+    return buffer;
+}
+
+/**
+ * Parse comma-separated stamps from trace header.
+ * @param   t           Trace structure to fill in (allocated if NULL).
+ * @param   header      Header value string.
+ * @return  Trace structure (NULL if allocation failed).
+ **/
+Trace * trace_parse(Trace *t, const char *header) {
+    if (!t && !(t = trace_create())) return NULL;
+
+    const char *cursor = header;
+    for (size_t s = 0; s < TRACE_STAGES && cursor && *cursor; s++) {
+        char *end;
+        uint64_t stamp = strtoull(cursor, &end, 10);
+        if (end == cursor) break;
+        if (stamp) t->stamps[s] = stamp;
+        cursor = (*end == ',') ? end + 1 : NULL;
+    }
+
+    return t;
+}
+
+/**
+ * Decide whether the next message should be traced (1 in rate).
+ * @param   tracer      Tracer structure.
+ * @return  Whether or not to trace message.
+ **/
+bool tracer_sample(Tracer *tracer) {
+    uint64_t rate = __atomic_load_n(&tracer->rate, __ATOMIC_RELAXED);
+    if (!rate) return false;
+    return __atomic_fetch_add(&tracer->sequence, 1, __ATOMIC_RELAXED) % rate == 0;
+}
+
+/**
+ * Record latency of stage (from the closest earlier stamp) in histogram.
+ * @param   tracer      Tracer structure.
+ * @param   t           Trace structure (ignored if NULL).
+ * @param   stage       Stage whose latency to record.
+ **/
+void tracer_record(Tracer *tracer, const Trace *t, TraceStage stage) {
+    if (!t || !t->stamps[stage]) return;
+
+    for (int previous = stage - 1; previous >= 0; previous--) {
+        if (!t->stamps[previous]) continue;
+        if (t->stamps[previous] > t->stamps[stage]) return;
+
+        uint64_t latency = t->stamps[stage] - t->stamps[previous];
+        uint64_t micros  = latency / 1000;
+        size_t   bucket  = micros ? 64 - __builtin_clzll(micros) : 0;
+        if (bucket >= TRACE_BUCKETS) bucket = TRACE_BUCKETS - 1;
+
+        Histogram *h = &tracer->stages[stage];
+        __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->total, latency, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+/**
+ * Estimate latency percentile from histogram.
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile to compute (0.0 - 100.0).
+ * @return  Upper bound of bucket containing percentile (nanoseconds).
+ **/
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (!count) return 0;
+
+    uint64_t rank = (uint64_t)(count * percentile / 100.0);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < TRACE_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (seen > rank || b == TRACE_BUCKETS - 1) {
+            return (1UL << b) * 1000;
+        }
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
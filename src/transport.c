@@ -0,0 +1,258 @@
+/* transport.c: SMQ Transport registry */
+
+#include "smq/transport.h"
+#include "smq/utils.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Constants */
+
+static const Transport *TRANSPORTS[] = {
+    &LocalTransport,
+    &SHMTransport,
+    &HTTPTransport,
+    &H2CTransport,
+    NULL,
+};
+
+/* Internal Functions */
+
+/**
+ * Match topic words against pattern words (either may be NULL at the end).
+ **/
+static bool transport_match_words(const char *pattern, const char *topic) {
+    if (!pattern) return !topic;
+
+    const char *pattern_end  = strchr(pattern, '.');
+    const char *pattern_next = pattern_end ? pattern_end + 1 : NULL;
+    size_t      pattern_size = pattern_end ? (size_t)(pattern_end - pattern) : strlen(pattern);
+
+    if (pattern_size == 1 && pattern[0] == '#') {
+        // Multi-word wildcard: try consuming zero or more topic words
+        while (true) {
+            if (transport_match_words(pattern_next, topic)) return true;
+            if (!topic) return false;
+            const char *topic_end = strchr(topic, '.');
+            topic = topic_end ? topic_end + 1 : NULL;
+        }
+    }
+
+    if (!topic) return false;
+
+    const char *topic_end  = strchr(topic, '.');
+    const char *topic_next = topic_end ? topic_end + 1 : NULL;
+    size_t      topic_size = topic_end ? (size_t)(topic_end - topic) : strlen(topic);
+
+    if (!(pattern_size == 1 && pattern[0] == '*')) {
+        if (pattern_size != topic_size || strncmp(pattern, topic, topic_size) != 0) {
+            return false;
+        }
+    }
+
+    return transport_match_words(pattern_next, topic_next);
+}
+
+/* Functions */
+
+/**
+ * Lookup Transport that handles the scheme of the specified URL.
+ * @param   url         URL string.
+ * @return  Transport structure (NULL if scheme is not supported).
+ **/
+const Transport * transport_lookup(const char *url) {
+    if (!url) return NULL;
+
+    for (const Transport **t = TRANSPORTS; *t; t++) {
+        if (strncmp(url, (*t)->scheme, strlen((*t)->scheme)) == 0) {
+            return *t;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return path portion of URL (everything after the scheme and authority).
+ * @param   url         URL string.
+ * @return  Pointer to path inside url (empty string if there is no path).
+ **/
+const char * transport_path(const char *url) {
+    const char *authority = strstr(url, "://");
+    authority = authority ? authority + 3 : url;
+
+    const char *path = strchr(authority, '/');
+    return path ? path : authority + strlen(authority);
+}
+
+/**
+ * Parse path of Request into one of the broker REST API routes:
+ *
+ *  PUT     /topic/$topic               Publish message to $topic.
+ *  GET     /queue/$queue               Retrieve one message from $queue.
+ *  PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
+ *  DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+ *  PUT     /ack/$queue                 Acknowledge leased messages.
+ *  PUT     /nack/$queue                Return leased messages to $queue.
+ *  GET     /health                     Report that broker is up.
+ *
+ * Any query string (ie. ?lease=) is left for transport_query.
+ *
+ * @param   method      Request method string.
+ * @param   path        Request path string.
+ * @param   queue       Set to newly allocated queue name (if any).
+ * @param   topic       Set to newly allocated topic name (if any).
+ * @return  Route matched by method and path.
+ **/
+Route transport_route(const char *method, const char *path, char **queue, char **topic) {
+    *queue = NULL;
+    *topic = NULL;
+
+    if (!method || !path) return ROUTE_UNKNOWN;
+
+    size_t length = strcspn(path, "?");
+
+    if (strncmp(path, "/topic/", 7) == 0 && streq(method, "PUT")) {
+        *topic = transport_unescape(strndup(path + 7, length - 7));
+        return *topic ? ROUTE_PUBLISH : ROUTE_UNKNOWN;
+    }
+
+    if (strncmp(path, "/queue/", 7) == 0 && streq(method, "GET")) {
+        *queue = transport_unescape(strndup(path + 7, length - 7));
+        return *queue ? ROUTE_RETRIEVE : ROUTE_UNKNOWN;
+    }
+
+    if (strncmp(path, "/ack/", 5) == 0 && streq(method, "PUT")) {
+        *queue = transport_unescape(strndup(path + 5, length - 5));
+        return *queue ? ROUTE_ACK : ROUTE_UNKNOWN;
+    }
+
+    if (strncmp(path, "/nack/", 6) == 0 && streq(method, "PUT")) {
+        *queue = transport_unescape(strndup(path + 6, length - 6));
+        return *queue ? ROUTE_NACK : ROUTE_UNKNOWN;
+    }
+
+    if (length == 7 && strncmp(path, "/health", 7) == 0 && streq(method, "GET")) {
+        return ROUTE_HEALTH;
+    }
+
+    if (strncmp(path, "/subscription/", 14) == 0) {
+        char *name      = strndup(path + 14, length - 14);
+        char *separator = name ? strrchr(name, '/') : NULL;
+        if (separator) {
+            *separator = 0;
+            if (streq(method, "PUT") || streq(method, "DELETE")) {
+                *queue = transport_unescape(name);
+                *topic = transport_unescape(strdup(separator + 1));
+                if (*topic) {
+                    return streq(method, "PUT") ? ROUTE_SUBSCRIBE : ROUTE_UNSUBSCRIBE;
+                }
+                *queue = NULL;
+            }
+        }
+        free(name);
+    }
+
+    return ROUTE_UNKNOWN;
+}
+
+/**
+ * Return whether or not topic matches subscription pattern.
+ *
+ * Topics are words separated by '.', where '*' in a pattern matches exactly
+ * one word and '#' matches zero or more words (ie. metrics.*.cpu, metrics.#).
+ *
+ * @param   pattern     Subscription pattern.
+ * @param   topic       Published topic.
+ * @return  Whether or not pattern matches topic.
+ **/
+bool transport_match(const char *pattern, const char *topic) {
+    if (!pattern || !topic) return false;
+    return transport_match_words(pattern, topic);
+}
+
+/**
+ * Return numeric value of query parameter (ie. wait in ?lease=100&wait=0).
+ * @param   path        Request path string.
+ * @param   name        Name of parameter.
+ * @param   value       Value to return if parameter is missing or invalid.
+ * @return  Value of parameter.
+ **/
+long transport_query(const char *path, const char *name, long value) {
+    size_t      length = strlen(name);
+    const char *query  = path ? strchr(path, '?') : NULL;
+
+    for (; query; query = strchr(query, '&')) {
+        query++;
+        if (strncmp(query, name, length) || query[length] != '=') continue;
+
+        char *end;
+        long number = strtol(query + length + 1, &end, 10);
+        if (end == query + length + 1 || (*end && *end != '&') || number < 0) break;
+        return number;
+    }
+
+    return value;
+}
+
+/**
+ * Percent-escape string so it can be used as a URL path component.
+ * @param   buffer      Buffer to store escaped string.
+ * @param   size        Size of buffer.
+ * @param   s           String to escape.
+ * @return  Escaped string in buffer (truncated if buffer is too small).
+ **/
+char * transport_escape(char *buffer, size_t size, const char *s) {
+    size_t length = 0;
+
+    for (; s && *s && length + 4 <= size; s++) {
+        if (isalnum((unsigned char)*s) || strchr("-._~*", *s)) {
+            buffer[length++] = *s;
+        } else {
+            length += snprintf(buffer + length, size - length, "%%%02X", (unsigned char)*s);
+        }
+    }
+
+    if (size) buffer[min(length, size - 1)] = 0;
+    return buffer;
+}
+
+/**
+ * Decode percent-escaped characters in string (in place).
+ * @param   s           String to decode.
+ * @return  Decoded string.
+ **/
+char * transport_unescape(char *s) {
+    if (!s) return NULL;
+
+    char *writer = s;
+    for (char *reader = s; *reader; reader++) {
+        if (reader[0] == '%' && isxdigit(reader[1]) && isxdigit(reader[2])) {
+            char hex[3] = {reader[1], reader[2], 0};
+            *writer++ = strtol(hex, NULL, 16);
+            reader += 2;
+        } else {
+            *writer++ = *reader;
+        }
+    }
+    *writer = 0;
+    return s;
+}
+
+/**
+ * Return newly allocated response string formatted like the HTTP broker's.
+ * @param   format      printf style format string.
+ * @return  Newly allocated response string.
+ **/
+char * transport_response(const char *format, ...) {
+    char buffer[BUFSIZ];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return strdup(buffer);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,261 @@
+/* wheel.c: SMQ Hierarchical Timer Wheel of Requests */
+
+#include "smq/wheel.h"
+#include "smq/utils.h"
+
+#include <stdlib.h>
+
+#ifndef WHEEL_CAPACITY
+#define WHEEL_CAPACITY (1<<22)
+#endif
+
+/* Internal Functions */
+
+/**
+ * Append Request to slot list (wheel lock must be held).
+ **/
+static void wheel_append(WheelSlot *slot, Request *r) {
+    r->next = NULL;
+    if (slot->tail) {
+        slot->tail->next = r;
+    } else {
+        slot->head = r;
+    }
+    slot->tail = r;
+}
+
+/**
+ * Place Request in slot covering its due time (wheel lock must be held).
+ *
+ * Level L holds Requests due between 2^(8L) and 2^(8(L+1)) ticks from now,
+ * in the slot picked by bits 8L to 8L+7 of their due tick, so each slot
+ * comes up again exactly when its range begins.  Requests due beyond the
+ * top level are parked in its farthest slot and placed again from there.
+ *
+ * @param   w       Wheel structure.
+ * @param   r       Request structure (with due set).
+ * @return  Tick Request was placed at.
+ **/
+static uint64_t wheel_place(Wheel *w, Request *r) {
+    // Round up, so that a Request never comes due early
+    uint64_t tick  = r->due > w->start ? (r->due - w->start + WHEEL_TICK - 1) / WHEEL_TICK : 0;
+    uint64_t delta = tick > w->tick ? tick - w->tick : 0;
+    size_t   level = 0;
+
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    tick = w->tick + delta;
+
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    wheel_append(&w->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)], r);
+    return tick;
+}
+
+/**
+ * Expire every tick up to now, moving due Requests onto list (wheel lock
+ * must be held).
+ *
+ * At each tick where a level's lower bits wrap to zero, the next slot of
+ * that level is cascaded down into finer slots; then the level 0 slot of the
+ * tick, which only holds Requests due at exactly that tick, comes due.  Both
+ * steps touch each Request a bounded number of times (once per level).
+ *
+ * @param   w       Wheel structure.
+ * @param   now     Current time (CLOCK_MONOTONIC ns).
+ * @param   due     List slot to append due Requests to.
+ **/
+static void wheel_advance(Wheel *w, uint64_t now, WheelSlot *due) {
+    uint64_t target = now > w->start ? (now - w->start) / WHEEL_TICK : 0;
+
+    while (w->tick <= target) {
+        if (!w->size) {         // Nothing to expire, so skip straight to now
+            w->tick = target + 1;
+            break;
+        }
+
+        for (size_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (w->tick & ((1ULL << (WHEEL_BITS * level)) - 1)) continue;
+
+            WheelSlot *slot = &w->slots[level][(w->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            Request   *r    = slot->head;
+            *slot = (WheelSlot){0};
+            while (r) {
+                Request *next = r->next;
+                wheel_place(w, r);
+                r = next;
+            }
+        }
+
+        WheelSlot *slot = &w->slots[0][w->tick & (WHEEL_SLOTS - 1)];
+        for (Request *r = slot->head; r; r = r->next) {
+            w->size--;
+        }
+        if (slot->head) {
+            if (due->tail) {
+                due->tail->next = slot->head;
+            } else {
+                due->head = slot->head;
+            }
+            due->tail = slot->tail;
+            *slot = (WheelSlot){0};
+        }
+
+        w->tick++;
+    }
+}
+
+/**
+ * Return tick by which wheel must be advanced again (wheel lock must be held).
+ *
+ * That is the first occupied level 0 slot before the next level 0 wrap, or
+ * the wrap itself (when finer slots may be filled by cascading, which may
+ * be the next tick).
+ *
+ * @param   w       Wheel structure.
+ * @return  Tick (UINT64_MAX if wheel is empty).
+ **/
+static uint64_t wheel_next(Wheel *w) {
+    if (!w->size) return UINT64_MAX;
+
+    uint64_t wrap = (w->tick + WHEEL_SLOTS - 1) & ~(uint64_t)(WHEEL_SLOTS - 1);
+    for (uint64_t tick = w->tick; tick < wrap; tick++) {
+        if (w->slots[0][tick & (WHEEL_SLOTS - 1)].head) {
+            return tick;
+        }
+    }
+    return wrap;
+}
+
+/* Functions */
+
+/**
+ * Create timer wheel.
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots with WHEEL_TICK
+ * resolution, so adding and expiring a Request are O(1) and the wheel's
+ * own memory is fixed no matter how many Requests it holds (each Request
+ * is linked through its next pointer).
+ *
+ * @return  Newly allocated wheel structure.
+ **/
+Wheel * wheel_create() {
+    Wheel *w = calloc(1, sizeof(Wheel));
+
+    if (w) {
+        w->start    = deadline_after(0);
+        w->wake     = UINT64_MAX;
+        w->capacity = WHEEL_CAPACITY;
+        w->running  = true;
+
+        mutex_init(&w->lock, NULL);
+        cond_init(&w->changed, NULL);
+    }
+
+    return w;
+}
+
+/**
+ * Delete timer wheel (and any Requests still scheduled).
+ * @param   w       Wheel structure.
+ **/
+void wheel_delete(Wheel *w) {
+    if (!w) return;
+
+    for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+        for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+            Request *r = w->slots[level][i].head;
+            while (r) {
+                Request *next = r->next;
+                request_delete(r);
+                r = next;
+            }
+        }
+    }
+
+    cond_destroy(&w->changed);
+    mutex_destroy(&w->lock);
+    free(w);
+}
+
+/**
+ * Shutdown timer wheel (wakes up waiter, scheduled Requests stay put).
+ * @param   w       Wheel structure.
+ **/
+void wheel_shutdown(Wheel *w) {
+    mutex_lock(&w->lock);
+    w->running = false;
+    cond_broadcast(&w->changed);
+    mutex_unlock(&w->lock);
+}
+
+/**
+ * Set the maximum number of Requests the wheel holds.
+ * @param   w           Wheel structure.
+ * @param   capacity    Maximum number of scheduled Requests (at least 1).
+ **/
+void wheel_capacity(Wheel *w, size_t capacity) {
+    if (!w) return;
+
+    mutex_lock(&w->lock);
+    w->capacity = capacity ? capacity : 1;
+    mutex_unlock(&w->lock);
+}
+
+/**
+ * Schedule Request to come due at specified time.
+ * @param   w       Wheel structure.
+ * @param   r       Request structure.
+ * @param   due     When Request comes due (times in the past are due next tick).
+ * @return  Whether or not wheel took ownership of Request (false if full or shut down).
+ **/
+bool wheel_add(Wheel *w, Request *r, Deadline due) {
+    if (!w || !r) return false;
+
+    mutex_lock(&w->lock);
+    if (!w->running || w->size >= w->capacity) {
+        mutex_unlock(&w->lock);
+        return false;
+    }
+
+    r->due = due ? due : 1;
+    w->size++;
+
+    // Only wake the waiter if it would otherwise sleep past this Request
+    if (wheel_place(w, r) < w->wake) {
+        cond_signal(&w->changed);
+    }
+    mutex_unlock(&w->lock);
+    return true;
+}
+
+/**
+ * Take every Request that is due (wait until one is, at most until deadline).
+ * @param   w           Wheel structure.
+ * @param   deadline    When to give up waiting.
+ * @return  Due Requests linked in order of due time (NULL on timeout or shutdown).
+ **/
+Request * wheel_take(Wheel *w, Deadline deadline) {
+    WheelSlot due = {0};
+
+    mutex_lock(&w->lock);
+    while (w->running) {
+        wheel_advance(w, deadline_after(0), &due);
+        if (due.head || deadline_expired(deadline)) break;
+
+        uint64_t next = wheel_next(w);
+        Deadline wake = next == UINT64_MAX ? DEADLINE_NEVER : w->start + next * WHEEL_TICK;
+
+        w->wake = next;
+        deadline_wait(&w->changed, &w->lock, min(wake, deadline));
+        w->wake = UINT64_MAX;
+    }
+    mutex_unlock(&w->lock);
+
+    return due.head;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,289 @@
+/* bench_load.c: SMQ End-to-End Load Generator (Benchmark) */
+
+#include "smq/client.h"
+#include "smq/probe.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
+
+/* Globals */
+
+const char * URL        = "smq://local";
+size_t       PUBLISHERS = 1;
+size_t       SUBSCRIBERS= 1;
+size_t       TOPICS     = 1;
+size_t       SIZE       = 64;       // Message body size (bytes)
+double       DURATION   = 5;        // Seconds per rate
+double       DRAIN      = 2;        // Seconds to wait for in-flight messages
+bool         JSON       = false;
+const char * PROBES     = NULL;     // Chrome trace to write (needs make PROBES=1)
+
+/* Structures */
+
+typedef struct {
+    SMQ        *smq;
+    size_t      id;
+    size_t      round;
+    double      rate;               // Messages per second (0 for closed loop)
+    uint64_t    start;              // CLOCK_MONOTONIC ns
+    uint64_t    stop;               // CLOCK_MONOTONIC ns
+    size_t      sent;
+} Publisher;
+
+typedef struct {
+    SMQ        *smq;
+    bool        running;
+    uint64_t   *latencies;          // Nanoseconds (from intended send time)
+    size_t      received;
+    size_t      capacity;
+    uint64_t    last;               // When last message was received (ns)
+} Subscriber;
+
+/* Threads */
+
+/**
+ * Publish messages on a fixed schedule (open loop) or back to back (closed
+ * loop).  Each body carries the time the message was *meant* to be sent, so
+ * a publisher that falls behind (ie. blocked on a full outgoing queue) still
+ * charges the delay to the messages it could not send on time, instead of
+ * hiding it (coordinated omission).
+ **/
+void *publisher(void *arg) {
+    Publisher *p = (Publisher *)arg;
+    char topic[BUFSIZ];
+    char body[SIZE + 64];
+    uint64_t interval = p->rate > 0 ? (uint64_t)(1e9 / p->rate) : 0;
+
+    for (uint64_t intended = p->start; ; intended += interval) {
+        uint64_t now = trace_now();
+        if (now >= p->stop) break;
+
+        if (interval && now < intended) {
+            struct timespec ts = {intended / 1000000000, intended % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } else if (!interval) {
+            intended = now;
+        }
+
+        snprintf(topic, sizeof(topic), "load.%lu.%lu", p->round, (p->id + p->sent) % TOPICS);
+        int length = snprintf(body, sizeof(body), "%lu %lu ", intended, p->sent);
+        if ((size_t)length < SIZE) {
+            memset(body + length, 'x', SIZE - length);
+            length = SIZE;
+        }
+        body[length] = 0;
+
+        smq_publish(p->smq, topic, body);
+        p->sent++;
+    }
+
+    return NULL;
+}
+
+void *subscriber(void *arg) {
+    Subscriber *s = (Subscriber *)arg;
+
+    while (__atomic_load_n(&s->running, __ATOMIC_ACQUIRE)) {
+        char *message = smq_retrieve(s->smq);
+        if (!message) continue;
+
+        uint64_t now      = trace_now();
+        uint64_t intended = strtoull(message, NULL, 10);
+        free(message);
+
+        if (s->received == s->capacity) {
+            s->capacity  = s->capacity ? s->capacity * 2 : 1<<12;
+            s->latencies = realloc(s->latencies, s->capacity * sizeof(uint64_t));
+            assert(s->latencies);
+        }
+        s->latencies[s->received++] = now > intended ? now - intended : 0;
+        s->last = now;
+    }
+
+    return NULL;
+}
+
+/* Functions */
+
+int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(uint64_t *latencies, size_t n, double p) {
+    if (!n) return 0;
+    size_t rank = (size_t)(p / 100.0 * (n - 1) + 0.5);
+    return latencies[rank];
+}
+
+/**
+ * Run one round at rate and print one CSV row or JSON object.
+ * @param   round       Round number (keeps queues and topics of rounds apart).
+ * @param   rate        Total publish rate in messages per second (0 for closed loop).
+ **/
+void run(size_t round, double rate) {
+    Thread     pthreads[PUBLISHERS];
+    Thread     sthreads[SUBSCRIBERS];
+    Publisher  publishers[PUBLISHERS];
+    Subscriber subscribers[SUBSCRIBERS];
+    char name[BUFSIZ];
+    char topic[BUFSIZ];
+
+    for (size_t s = 0; s < SUBSCRIBERS; s++) {
+        snprintf(name, sizeof(name), "load.%d.%lu.sub.%lu", getpid(), round, s);
+        subscribers[s] = (Subscriber){ .smq = smq_create(name, URL, NULL), .running = true };
+        assert(subscribers[s].smq);
+
+        // Every topic gets at least one subscriber
+        for (size_t t = s % TOPICS; t < TOPICS; t += SUBSCRIBERS) {
+            snprintf(topic, sizeof(topic), "load.%lu.%lu", round, t);
+            smq_subscribe(subscribers[s].smq, topic);
+        }
+        thread_create(&sthreads[s], NULL, subscriber, &subscribers[s]);
+    }
+
+    uint64_t start = trace_now();
+    uint64_t stop  = start + (uint64_t)(DURATION * 1e9);
+    for (size_t p = 0; p < PUBLISHERS; p++) {
+        snprintf(name, sizeof(name), "load.%d.%lu.pub.%lu", getpid(), round, p);
+        publishers[p] = (Publisher){
+            .smq   = smq_create(name, URL, NULL),
+            .id    = p,
+            .round = round,
+            .rate  = rate / PUBLISHERS,
+            .start = start,
+            .stop  = stop,
+        };
+        assert(publishers[p].smq);
+        thread_create(&pthreads[p], NULL, publisher, &publishers[p]);
+    }
+
+    size_t sent = 0;
+    for (size_t p = 0; p < PUBLISHERS; p++) {
+        thread_join(pthreads[p], NULL);
+        sent += publishers[p].sent;
+    }
+
+    // Give in-flight messages a chance to arrive before counting
+    usleep(DRAIN * 1e6);
+
+    for (size_t s = 0; s < SUBSCRIBERS; s++) {
+        __atomic_store_n(&subscribers[s].running, false, __ATOMIC_RELEASE);
+        smq_shutdown(subscribers[s].smq);
+        thread_join(sthreads[s], NULL);
+    }
+    for (size_t p = 0; p < PUBLISHERS; p++) {
+        smq_delete(publishers[p].smq);
+    }
+
+    // Merge and sort samples for exact percentiles
+    size_t   received = 0;
+    uint64_t last     = start;
+    for (size_t s = 0; s < SUBSCRIBERS; s++) {
+        received += subscribers[s].received;
+        last      = subscribers[s].last > last ? subscribers[s].last : last;
+    }
+    uint64_t *latencies = calloc(received ? received : 1, sizeof(uint64_t));
+    assert(latencies);
+    size_t offset = 0;
+    for (size_t s = 0; s < SUBSCRIBERS; s++) {
+        memcpy(latencies + offset, subscribers[s].latencies, subscribers[s].received * sizeof(uint64_t));
+        offset += subscribers[s].received;
+        free(subscribers[s].latencies);
+        smq_delete(subscribers[s].smq);
+    }
+    qsort(latencies, received, sizeof(uint64_t), compare);
+
+    // Sustained rate at which messages came out the other end
+    double throughput = last > start ? received / ((last - start) / 1e9) : 0;
+    double p50  = percentile(latencies, received, 50.0)  / 1000.0;
+    double p90  = percentile(latencies, received, 90.0)  / 1000.0;
+    double p99  = percentile(latencies, received, 99.0)  / 1000.0;
+    double p999 = percentile(latencies, received, 99.9)  / 1000.0;
+    double max  = received ? latencies[received - 1] / 1000.0 : 0;
+    free(latencies);
+
+    if (JSON) {
+        printf("%s{\"rate\": %.0f, \"publishers\": %lu, \"subscribers\": %lu, \"topics\": %lu, \"size\": %lu, "
+               "\"sent\": %lu, \"received\": %lu, \"throughput\": %.1f, "
+               "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+               round ? ",\n " : "[", rate, PUBLISHERS, SUBSCRIBERS, TOPICS, SIZE,
+               sent, received, throughput, p50, p90, p99, p999, max);
+    } else {
+        printf("%.0f,%lu,%lu,%lu,%lu,%lu,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               rate, PUBLISHERS, SUBSCRIBERS, TOPICS, SIZE,
+               sent, received, throughput, p50, p90, p99, p999, max);
+    }
+    fflush(stdout);
+}
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -u URL        Broker URL (default: smq://local, or http://host:port)\n");
+    fprintf(stderr, "    -p N          Number of publisher SMQ instances (default: 1)\n");
+    fprintf(stderr, "    -s N          Number of subscriber SMQ instances (default: 1)\n");
+    fprintf(stderr, "    -t N          Number of topics (default: 1)\n");
+    fprintf(stderr, "    -r RATES      Comma separated total messages/sec (0 for closed loop, default: 0)\n");
+    fprintf(stderr, "    -d SECONDS    Duration of each rate (default: 5)\n");
+    fprintf(stderr, "    -w SECONDS    Time to wait for in-flight messages (default: 2)\n");
+    fprintf(stderr, "    -m BYTES      Message size (default: 64)\n");
+    fprintf(stderr, "    -j            Output JSON instead of CSV\n");
+    fprintf(stderr, "    -T PATH       Write Chrome trace of probes to PATH (needs make PROBES=1)\n");
+    exit(status);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    const char *rates = "0";
+    int option;
+
+    while ((option = getopt(argc, argv, "u:p:s:t:r:d:w:m:jT:h")) != -1) {
+        switch (option) {
+            case 'u': URL         = optarg; break;
+            case 'p': PUBLISHERS  = strtoul(optarg, NULL, 10); break;
+            case 's': SUBSCRIBERS = strtoul(optarg, NULL, 10); break;
+            case 't': TOPICS      = strtoul(optarg, NULL, 10); break;
+            case 'r': rates       = optarg; break;
+            case 'd': DURATION    = strtod(optarg, NULL); break;
+            case 'w': DRAIN       = strtod(optarg, NULL); break;
+            case 'm': SIZE        = strtoul(optarg, NULL, 10); break;
+            case 'j': JSON        = true; break;
+            case 'T': PROBES      = optarg; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    if (!PUBLISHERS || !SUBSCRIBERS || !TOPICS || DURATION <= 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!JSON) {
+        puts("rate,publishers,subscribers,topics,size,sent,received,throughput,p50_us,p90_us,p99_us,p999_us,max_us");
+    }
+
+    char *list = strdup(rates);
+    size_t round = 0;
+    for (char *rate = strtok(list, ","); rate; rate = strtok(NULL, ","), round++) {
+        run(round, strtod(rate, NULL));
+    }
+    free(list);
+
+    if (JSON) {
+        puts("]");
+    }
+
+    if (PROBES && !probe_export(PROBES)) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
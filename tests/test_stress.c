@@ -0,0 +1,181 @@
+/* test_stress.c: Stress SMQ Concurrent Queue of Requests (Functional) */
+
+#include "smq/thread.h"
+#include "smq/queue.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+
+/* Globals */
+
+size_t   NPRODUCERS = 64;
+size_t   NCONSUMERS = 64;
+size_t   NREQUESTS  = 1<<10;    // Per producer
+size_t   CAPACITY   = 16;       // Small, so producers block at capacity
+bool     SHUTDOWN   = false;    // Shut queue down at a random time
+unsigned SEED       = 0;
+
+size_t   Consumed   = 0;        // Requests popped by all consumers
+bool     Stopped    = false;    // Whether queue has been shut down
+
+/* Structures */
+
+typedef struct {
+    Queue  *queue;
+    size_t  id;
+    size_t  operations;         // Requests pushed or popped by this thread
+} Worker;
+
+/* Threads */
+
+void *producer(void *arg) {
+    Worker *w = (Worker *)arg;
+    char body[BUFSIZ];
+
+    for (size_t m = 0; m < NREQUESTS; m++) {
+        snprintf(body, sizeof(body), "%lu", w->id);
+        Request *r = request_create("PUT", "stress", body);
+        assert(r);
+
+        // Push fails (and leaves Request to us) only once queue is shut down
+        if (!queue_push(w->queue, r)) {
+            assert(__atomic_load_n(&Stopped, __ATOMIC_ACQUIRE));
+            request_delete(r);
+            break;
+        }
+        w->operations++;
+    }
+
+    return NULL;
+}
+
+void *consumer(void *arg) {
+    Worker *w = (Worker *)arg;
+    size_t total = NPRODUCERS * NREQUESTS;
+
+    while (__atomic_load_n(&Consumed, __ATOMIC_RELAXED) < total) {
+        Request *r = queue_pop(w->queue, 10);
+        if (!r) {
+            if (__atomic_load_n(&Stopped, __ATOMIC_ACQUIRE)) break;
+            continue;
+        }
+
+        assert(streq(r->method, "PUT"));
+        assert(streq(r->url, "stress"));
+        assert((size_t)atoi(r->body) < NPRODUCERS);
+
+        request_delete(r);
+        w->operations++;
+        __atomic_add_fetch(&Consumed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/* Functions */
+
+double elapsed(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Report throughput and fairness (how evenly operations were spread across
+ * threads, as the coefficient of variation of per-thread operations).
+ **/
+size_t report(const char *kind, Worker *workers, size_t n, double seconds) {
+    size_t total = 0;
+    size_t least = SIZE_MAX;
+    size_t most  = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        total += workers[i].operations;
+        least  = min(least, workers[i].operations);
+        most   = workers[i].operations > most ? workers[i].operations : most;
+    }
+
+    double mean     = (double)total / n;
+    double variance = 0;
+    for (size_t i = 0; i < n; i++) {
+        variance += pow(workers[i].operations - mean, 2) / n;
+    }
+
+    printf("%-9s threads: %4lu, ops: %8lu, ops/sec: %10.0f, per thread: min %lu / mean %.1f / max %lu, cv: %.3f\n",
+        kind, n, total, total / seconds, least, mean, most, mean ? sqrt(variance) / mean : 0);
+    return total;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) NPRODUCERS = atoi(argv[1]);
+    if (argc > 2) NCONSUMERS = atoi(argv[2]);
+    if (argc > 3) NREQUESTS  = atoi(argv[3]);
+    if (argc > 4) CAPACITY   = atoi(argv[4]);
+    if (argc > 5) SHUTDOWN   = atoi(argv[5]);
+    if (argc > 6) SEED       = atoi(argv[6]);
+    if (!SEED)    SEED       = time(NULL) ^ getpid();
+
+    printf("producers: %lu, consumers: %lu, requests: %lu, capacity: %lu, shutdown: %d, seed: %u\n",
+        NPRODUCERS, NCONSUMERS, NREQUESTS, CAPACITY, SHUTDOWN, SEED);
+    srand(SEED);
+
+    Thread producers[NPRODUCERS];
+    Thread consumers[NCONSUMERS];
+    Worker pworkers[NPRODUCERS];
+    Worker cworkers[NCONSUMERS];
+    Queue *q = queue_create();
+    assert(q);
+    queue_capacity(q, CAPACITY);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t c = 0; c < NCONSUMERS; c++) {
+        cworkers[c] = (Worker){q, c, 0};
+        thread_create(&consumers[c], NULL, consumer, &cworkers[c]);
+    }
+
+    for (size_t p = 0; p < NPRODUCERS; p++) {
+        pworkers[p] = (Worker){q, p, 0};
+        thread_create(&producers[p], NULL, producer, &pworkers[p]);
+    }
+
+    if (SHUTDOWN) {
+        // Shut down while producers are (most likely) blocked at capacity
+        usleep(rand() % 50000);
+        __atomic_store_n(&Stopped, true, __ATOMIC_RELEASE);
+        queue_shutdown(q);
+    }
+
+    for (size_t p = 0; p < NPRODUCERS; p++) {
+        thread_join(producers[p], NULL);
+    }
+
+    if (!SHUTDOWN) {
+        __atomic_store_n(&Stopped, true, __ATOMIC_RELEASE);
+        queue_shutdown(q);
+    }
+
+    for (size_t c = 0; c < NCONSUMERS; c++) {
+        thread_join(consumers[c], NULL);
+    }
+
+    double seconds  = elapsed(&start);
+    size_t pushed   = report("producer", pworkers, NPRODUCERS, seconds);
+    size_t popped   = report("consumer", cworkers, NCONSUMERS, seconds);
+    size_t leftover = q->size;
+
+    // Every accepted Request is either consumed or still in the queue
+    printf("pushed: %lu, popped: %lu, leftover: %lu\n", pushed, popped, leftover);
+    assert(pushed == popped + leftover);
+    assert(SHUTDOWN || pushed == NPRODUCERS * NREQUESTS);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,281 @@
+/* unit_broker.c: Test SMQ In-Process Broker (Unit) */
+
+#include "smq/broker.h"
+#include "smq/transport.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+
+/* Constants */
+
+const char * QUEUE = "unit";
+const char * TOPIC = "testing";
+const char * BODY  = "genie in a bottle";
+
+/* Functions */
+
+int test_00_broker_create() {
+    Broker *b = broker_create();
+    assert(b);
+    assert(b->mailboxes == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_01_broker_subscribe() {
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(broker_subscribe(b, QUEUE, TOPIC));
+    assert(broker_subscribe(b, QUEUE, TOPIC));
+    assert(b->mailboxes);
+    assert(streq(b->mailboxes->name, QUEUE));
+    assert(streq(b->mailboxes->topics->name, TOPIC));
+    assert(b->mailboxes->topics->next == NULL);
+
+    assert(broker_unsubscribe(b, QUEUE, TOPIC));
+    assert(!broker_unsubscribe(b, QUEUE, TOPIC));
+    assert(!broker_unsubscribe(b, "missing", TOPIC));
+    assert(b->mailboxes->topics == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_02_broker_publish() {
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(broker_publish(b, TOPIC, BODY) == 0);
+
+    assert(broker_subscribe(b, "q0", TOPIC));
+    assert(broker_subscribe(b, "q1", TOPIC));
+    assert(broker_subscribe(b, "q2", "other"));
+    assert(broker_publish(b, TOPIC, BODY) == 2);
+    assert(broker_publish(b, "other", BODY) == 1);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_03_broker_retrieve() {
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(broker_retrieve(b, QUEUE, 10) == NULL);
+    assert(broker_subscribe(b, QUEUE, TOPIC));
+    assert(broker_publish(b, TOPIC, BODY) == 1);
+    assert(broker_publish(b, TOPIC, NULL) == 1);
+
+    char *message = broker_retrieve(b, QUEUE, 1000);
+    assert(message);
+    assert(streq(message, BODY));
+    free(message);
+
+    message = broker_retrieve(b, QUEUE, 1000);
+    assert(message);
+    assert(streq(message, ""));
+    free(message);
+
+    assert(broker_retrieve(b, QUEUE, 10) == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_04_broker_handle() {
+    Broker *b = broker_create();
+    assert(b);
+
+    Request subscribe   = {"PUT", "smq://local/subscription/unit/testing", NULL};
+    Request publish     = {"PUT", "smq://local/topic/testing", (char *)BODY};
+    Request retrieve    = {"GET", "smq://local/queue/unit", NULL};
+    Request unsubscribe = {"DELETE", "smq://local/subscription/unit/testing", NULL};
+    Request unknown     = {"GET", "smq://local/unknown", NULL};
+
+    assert(broker_handle(b, &publish, 10) == NULL);
+
+    char *response = broker_handle(b, &subscribe, 10);
+    assert(response);
+    free(response);
+
+    response = broker_handle(b, &publish, 10);
+    assert(response);
+    assert(strstr(response, "1 subscribers"));
+    free(response);
+
+    response = broker_handle(b, &retrieve, 1000);
+    assert(response);
+    assert(streq(response, BODY));
+    free(response);
+
+    response = broker_handle(b, &unsubscribe, 10);
+    assert(response);
+    free(response);
+
+    assert(broker_handle(b, &unsubscribe, 10) == NULL);
+    assert(broker_handle(b, &unknown, 10) == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_05_broker_wildcards() {
+    assert(transport_match("metrics.*.cpu", "metrics.h1.cpu"));
+    assert(!transport_match("metrics.*.cpu", "metrics.cpu"));
+    assert(!transport_match("metrics.*.cpu", "metrics.h1.h2.cpu"));
+    assert(transport_match("metrics.#", "metrics"));
+    assert(transport_match("metrics.#", "metrics.h1.mem"));
+    assert(transport_match("metrics.#.cpu", "metrics.h1.h2.cpu"));
+    assert(!transport_match("metrics.#.cpu", "metrics.h1.mem"));
+    assert(transport_match("#", "anything.at.all"));
+    assert(!transport_match("metrics", "metrics.h1"));
+
+    Broker *b = broker_create();
+    assert(b);
+
+    assert(broker_subscribe(b, "q0", "metrics.*.cpu"));
+    assert(broker_subscribe(b, "q1", "metrics.#"));
+    assert(broker_publish(b, "metrics.h1.cpu", BODY) == 2);
+    assert(broker_publish(b, "metrics.h1.mem", BODY) == 1);
+    assert(broker_publish(b, "logs.h1", BODY) == 0);
+
+    char *message = broker_retrieve(b, "q0", 1000);
+    assert(message);
+    free(message);
+    assert(broker_retrieve(b, "q0", 10) == NULL);
+
+    Request subscribe = {"PUT", "smq://local/subscription/q2/logs.%23", NULL};
+    char *response = broker_handle(b, &subscribe, 10);
+    assert(response);
+    assert(strstr(response, "logs.#"));
+    free(response);
+    assert(broker_publish(b, "logs.h1", BODY) == 1);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_06_broker_wait() {
+    assert(transport_query("/queue/unit?wait=25", "wait", 7) == 25);
+    assert(transport_query("/queue/unit?lease=100&wait=0", "wait", 7) == 0);
+    assert(transport_query("/queue/unit?lease=100", "wait", 7) == 7);
+    assert(transport_query("/queue/unit?await=5", "wait", 7) == 7);
+    assert(transport_query("/queue/unit?wait=x", "wait", 7) == 7);
+    assert(transport_query("/queue/unit", "wait", 7) == 7);
+
+    Broker *b = broker_create();
+    assert(b);
+    assert(broker_subscribe(b, "unit", "testing"));
+
+    // A poll of an empty queue gives up after wait rather than timeout
+    Request poll = {"GET", "smq://local/queue/unit?wait=10", NULL};
+    Deadline start = deadline_after(0);
+    assert(broker_handle(b, &poll, 60000) == NULL);
+    assert(deadline_after(0) - start < 1000000000ULL);
+
+    assert(broker_publish(b, "testing", BODY) == 1);
+    char *response = broker_handle(b, &poll, 60000);
+    assert(response);
+    assert(streq(response, BODY));
+    free(response);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+int test_07_broker_stalled() {
+    Broker *b = broker_create();
+    assert(b);
+    assert(broker_subscribe(b, "slow", "testing"));
+    assert(broker_subscribe(b, "slow", "alone"));
+    assert(broker_subscribe(b, "fast", "testing"));
+
+    Mailbox *slow = b->mailboxes;
+    while (slow && !streq(slow->name, "slow")) slow = slow->next;
+    assert(slow);
+    queue_capacity(slow->messages, 2);
+
+    Request publish = {"PUT", "smq://local/topic/testing", (char *)BODY};
+    Request alone   = {"PUT", "smq://local/topic/alone", (char *)BODY};
+    char *response;
+
+    for (int i = 0; i < 2; i++) {
+        response = broker_handle(b, &publish, 500);
+        assert(response);
+        assert(strstr(response, "2 subscribers"));
+        free(response);
+    }
+
+    // A subscriber that stops draining holds up the publish once (until
+    // timeout), and then fails it, without delivering to anyone
+    Deadline start = deadline_after(0);
+    assert(broker_handle(b, &publish, 500) == NULL);
+    assert(deadline_after(0) - start >= 400000000ULL);
+    assert(slow->stalled);
+
+    // ... after which publishes fail without waiting
+    start = deadline_after(0);
+    assert(broker_handle(b, &publish, 500) == NULL);
+    assert(broker_handle(b, &alone, 500) == NULL);
+    assert(deadline_after(0) - start < 250000000ULL);
+
+    // ... until it has room again
+    char *message = broker_retrieve(b, "slow", 1000);
+    assert(message);
+    free(message);
+    response = broker_handle(b, &publish, 500);
+    assert(response);
+    assert(strstr(response, "2 subscribers"));
+    free(response);
+    assert(!slow->stalled);
+
+    // The other subscriber only got the messages that were published
+    for (int i = 0; i < 3; i++) {
+        message = broker_retrieve(b, "fast", 0);
+        assert(message);
+        free(message);
+    }
+    assert(broker_retrieve(b, "fast", 0) == NULL);
+
+    broker_delete(b);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test broker_create\n");
+        fprintf(stderr, "    1. Test broker_subscribe\n");
+        fprintf(stderr, "    2. Test broker_publish\n");
+        fprintf(stderr, "    3. Test broker_retrieve\n");
+        fprintf(stderr, "    4. Test broker_handle\n");
+        fprintf(stderr, "    5. Test broker_wildcards\n");
+        fprintf(stderr, "    6. Test broker_wait\n");
+        fprintf(stderr, "    7. Test broker_stalled\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_broker_create(); break;
+        case 1:  status = test_01_broker_subscribe(); break;
+        case 2:  status = test_02_broker_publish(); break;
+        case 3:  status = test_03_broker_retrieve(); break;
+        case 4:  status = test_04_broker_handle(); break;
+        case 5:  status = test_05_broker_wildcards(); break;
+        case 6:  status = test_06_broker_wait(); break;
+        case 7:  status = test_07_broker_stalled(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
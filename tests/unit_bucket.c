@@ -0,0 +1,147 @@
+/* unit_bucket.c: Test SMQ Lock-Free Token Bucket (Unit) */
+
+#include "smq/bucket.h"
+#include "smq/thread.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+
+/* Constants */
+
+#define SECOND  (1000000000ULL)
+#define NOW     (1000 * SECOND)
+
+/* Threads */
+
+Bucket BUCKET;
+
+void * taker(void *arg) {
+    size_t *taken = arg;
+    for (size_t i = 0; i < 100000; i++) {
+        if (!bucket_take(&BUCKET, NOW, false)) (*taken)++;
+    }
+    return NULL;
+}
+
+/* Functions */
+
+int test_00_bucket_init() {
+    Bucket b = {0};
+
+    bucket_init(&b, 100, 10);
+    assert(b.interval == SECOND / 100);
+    assert(b.tolerance == 9 * SECOND / 100);
+
+    // A zero burst still lets one message through at a time
+    bucket_init(&b, 4, 0);
+    assert(b.interval == SECOND / 4);
+    assert(b.tolerance == 0);
+
+    // A zero rate is unlimited
+    bucket_init(&b, 0, 10);
+    for (size_t i = 0; i < 1000; i++) {
+        assert(bucket_take(&b, NOW, false) == 0);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_01_bucket_take() {
+    Bucket b = {0};
+    bucket_init(&b, 10, 5);
+
+    // A full bucket gives out its burst at once, then refills at rate
+    for (size_t i = 0; i < 5; i++) {
+        assert(bucket_take(&b, NOW, false) == 0);
+    }
+    assert(bucket_take(&b, NOW, false) == NOW + SECOND / 10);
+    assert(bucket_take(&b, NOW + SECOND / 20, false) == NOW + SECOND / 10);
+    assert(bucket_take(&b, NOW + SECOND / 10, false) == 0);
+    assert(bucket_take(&b, NOW + SECOND / 10, false) == NOW + 2 * SECOND / 10);
+
+    // An idle bucket refills up to its burst, but no further
+    uint64_t later = NOW + 10 * SECOND;
+    for (size_t i = 0; i < 5; i++) {
+        assert(bucket_take(&b, later, false) == 0);
+    }
+    assert(bucket_take(&b, later, false) != 0);
+    return EXIT_SUCCESS;
+}
+
+int test_02_bucket_reserve() {
+    Bucket b = {0};
+    bucket_init(&b, 10, 2);
+
+    // Reservations past the burst are handed out one interval apart
+    assert(bucket_take(&b, NOW, true) == 0);
+    assert(bucket_take(&b, NOW, true) == 0);
+    assert(bucket_take(&b, NOW, true) == NOW + 1 * SECOND / 10);
+    assert(bucket_take(&b, NOW, true) == NOW + 2 * SECOND / 10);
+    assert(bucket_take(&b, NOW, true) == NOW + 3 * SECOND / 10);
+
+    // ... and a plain take must wait behind them
+    assert(bucket_take(&b, NOW, false) == NOW + 4 * SECOND / 10);
+    return EXIT_SUCCESS;
+}
+
+int test_03_bucket_concurrent() {
+    Thread threads[4];
+    size_t taken[4] = {0};
+
+    bucket_init(&BUCKET, 1, 1000);
+    for (size_t i = 0; i < 4; i++) {
+        thread_create(&threads[i], NULL, taker, &taken[i]);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        thread_join(threads[i], NULL);
+    }
+
+    // Racing takers never get more than the burst between them
+    assert(taken[0] + taken[1] + taken[2] + taken[3] == 1000);
+    return EXIT_SUCCESS;
+}
+
+int test_04_bucket_refund() {
+    Bucket b = {0};
+    bucket_init(&b, 10, 2);
+
+    assert(bucket_take(&b, NOW, false) == 0);
+    assert(bucket_take(&b, NOW, false) == 0);
+    assert(bucket_take(&b, NOW, false) != 0);
+
+    // A refunded token can be taken again right away
+    bucket_refund(&b);
+    assert(bucket_take(&b, NOW, false) == 0);
+    assert(bucket_take(&b, NOW, false) != 0);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test bucket_init\n");
+        fprintf(stderr, "    1. Test bucket_take\n");
+        fprintf(stderr, "    2. Test bucket_reserve\n");
+        fprintf(stderr, "    3. Test bucket_concurrent\n");
+        fprintf(stderr, "    4. Test bucket_refund\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_bucket_init(); break;
+        case 1:  status = test_01_bucket_take(); break;
+        case 2:  status = test_02_bucket_reserve(); break;
+        case 3:  status = test_03_bucket_concurrent(); break;
+        case 4:  status = test_04_bucket_refund(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,315 @@
+/* unit_client.c: Test SMQ Client Configuration and Snapshots (Unit) */
+
+#include "smq/client.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+const char * HOST = "smq://local";
+
+/* Functions */
+
+SMQ * client_create(SMQConfig config) {
+    config.name    = "unit";
+    config.host    = HOST;
+    config.timeout = config.timeout ? config.timeout : 100;
+    return smq_create_ex(&config);
+}
+
+int test_00_client_config() {
+    // Defaults
+    SMQ *smq = client_create((SMQConfig){0});
+    assert(smq);
+    assert(smq->timeout == 100);
+    assert(smq->connect_timeout == 100);
+    assert(smq->retries == 3);
+    assert(smq->backoff == 100);
+    assert(smq->npushers == 1);
+    assert(smq->npullers == 1);
+    smq_delete(smq);
+
+    // Retries and backoff may be disabled (0 selects their defaults, as
+    // for every other tunable)
+    smq = client_create((SMQConfig){ .retries = SMQ_DISABLED, .backoff = SMQ_DISABLED });
+    assert(smq);
+    assert(smq->retries == 0);
+    assert(smq->backoff == 0);
+    smq_delete(smq);
+
+    smq = client_create((SMQConfig){ .retries = 5, .backoff = 20, .pushers = 2 });
+    assert(smq);
+    assert(smq->retries == 5);
+    assert(smq->backoff == 20);
+    assert(smq->npushers == 2);
+    smq_delete(smq);
+
+    // Invalid settings
+    assert(client_create((SMQConfig){ .pushers = 1000 }) == NULL);
+    assert(client_create((SMQConfig){ .backoff = -5 }) == NULL);
+    assert(client_create((SMQConfig){ .pusher.cpus = "3-1" }) == NULL);
+    return EXIT_SUCCESS;
+}
+
+int test_01_client_environment() {
+    // Environment overrides configuration (0 included)
+    setenv("SMQ_RETRIES", "0", 1);
+    setenv("SMQ_BACKOFF", "0", 1);
+    setenv("SMQ_TIMEOUT", "50", 1);
+    SMQ *smq = client_create((SMQConfig){ .retries = 5 });
+    assert(smq);
+    assert(smq->retries == 0);
+    assert(smq->backoff == 0);
+    assert(smq->timeout == 50);
+    smq_delete(smq);
+
+    setenv("SMQ_RETRIES", "7", 1);
+    setenv("SMQ_BACKOFF", "", 1);
+    smq = client_create((SMQConfig){0});
+    assert(smq);
+    assert(smq->retries == 7);
+    assert(smq->backoff == 100);
+    smq_delete(smq);
+
+    // Invalid values
+    setenv("SMQ_RETRIES", "-1", 1);
+    assert(client_create((SMQConfig){0}) == NULL);
+    setenv("SMQ_RETRIES", "3x", 1);
+    assert(client_create((SMQConfig){0}) == NULL);
+
+    unsetenv("SMQ_RETRIES");
+    unsetenv("SMQ_BACKOFF");
+    unsetenv("SMQ_TIMEOUT");
+    return EXIT_SUCCESS;
+}
+
+int test_02_client_partition() {
+    const char *topics[] = { "p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7" };
+    const size_t ntopics = sizeof(topics) / sizeof(topics[0]);
+    const size_t count   = 200;
+
+    char host[BUFSIZ], segment[BUFSIZ];
+    snprintf(host, sizeof(host), "smq://local,smq://shm/unit.%d", getpid());
+    snprintf(segment, sizeof(segment), "/smq.unit.%d", getpid());
+
+    SMQConfig config = { .name = "unit.partition", .host = host, .partition = true, .timeout = 100 };
+    SMQ *smq = smq_create_ex(&config);
+    assert(smq);
+    assert(smq->partitioned);
+    assert(smq->npushers == 2);
+    assert(smq->nlanes == 2);
+
+    // Each topic always waits in the same lane (that of its home broker)
+    for (size_t t = 0; t < ntopics; t++) {
+        char url[BUFSIZ];
+        snprintf(url, sizeof(url), "/topic/%s", topics[t]);
+        Request request = { .url = url };
+        Queue *lane = smq_outgoing(smq, &request);
+        assert(lane == smq->lanes[endpoints_home(smq->endpoints, url)]);
+        assert(lane == smq_outgoing(smq, &request));
+    }
+
+    for (size_t t = 0; t < ntopics; t++) {
+        smq_subscribe(smq, topics[t]);
+    }
+
+    // ... so the messages of each topic arrive in the order published
+    char body[BUFSIZ];
+    for (size_t i = 0; i < count; i++) {
+        for (size_t t = 0; t < ntopics; t++) {
+            snprintf(body, sizeof(body), "%s %lu", topics[t], i);
+            smq_publish(smq, topics[t], body);
+        }
+    }
+
+    size_t next[sizeof(topics) / sizeof(topics[0])] = {0};
+    for (size_t n = 0; n < count * ntopics; n++) {
+        char *message = smq_retrieve_until(smq, deadline_after(5000));
+        assert(message);
+
+        size_t t, i;
+        assert(sscanf(message, "p%lu %lu", &t, &i) == 2);
+        assert(t < ntopics);
+        assert(i == next[t]);
+        next[t]++;
+        free(message);
+    }
+
+    smq_delete(smq);
+    shm_unlink(segment);
+    return EXIT_SUCCESS;
+}
+
+int test_03_client_snapshot() {
+    char path[BUFSIZ], incomplete[BUFSIZ + 16];
+    snprintf(path, sizeof(path), "/tmp/unit_client.%d.snapshot", getpid());
+    snprintf(incomplete, sizeof(incomplete), "%s.incomplete", path);
+
+    // Every subscriber sees restored messages published to snapshot.*
+    SMQ *check = client_create((SMQConfig){0});
+    assert(check);
+    smq_subscribe(check, "snapshot.#");
+
+    // Pusher backs off on an unreachable broker, holding the first message
+    // (and the rest wait behind it)
+    SMQConfig config = { .name = "writer", .host = "127.0.0.1:1",
+                         .timeout = 100, .retries = 1, .backoff = 60000 };
+    SMQ *writer = smq_create_ex(&config);
+    assert(writer);
+    smq_publish(writer, "snapshot.out", "o0");
+    usleep(200000);
+    smq_publish(writer, "snapshot.out", "o1");
+    smq_publish_conflated(writer, "snapshot.out", "key", "o2");
+    assert(smq_publish_until(writer, "snapshot.out", "expired", deadline_after(50)));
+    smq_publish(writer, "snapshot.out", "o3");
+    assert(smq_publish_at(writer, "snapshot.later", "s0", deadline_after(60000)));
+    usleep(100000);
+
+    // Incoming messages not yet retrieved
+    SMQ *reader = client_create((SMQConfig){ .name = "reader" });
+    assert(reader);
+    smq_subscribe(reader, "incoming");
+    smq_publish(reader, "incoming", "i0");
+    smq_publish(reader, "incoming", "i1");
+    for (int i = 0; i < 100 && reader->incoming->size < 2; i++) usleep(10000);
+    assert(reader->incoming->size == 2);
+
+    // ... and those of a queue attached without merging
+    assert(smq_attach(reader, "reader.side", 1, false));
+    smq_subscribe_queue(reader, "reader.side", "side");
+    smq_publish(reader, "side", "a0");
+    Queue *side = reader->queues->next->incoming;
+    for (int i = 0; i < 100 && side->size < 1; i++) usleep(10000);
+    assert(side->size == 1);
+
+    assert(smq_snapshot(reader, path));
+    smq_delete(reader);
+
+    reader = client_create((SMQConfig){ .name = "reader", .snapshot = path });
+    assert(reader);
+    assert(access(path, F_OK) < 0);
+    assert(reader->incoming->size == 2);
+    for (const char *expected[] = { "i0", "i1", NULL }, **e = expected; *e; e++) {
+        char *message = smq_retrieve_until(reader, deadline_after(1000));
+        assert(message && streq(message, *e));
+        free(message);
+    }
+    char *message = smq_retrieve_from(reader, "reader.side", deadline_after(1000));
+    assert(message && streq(message, "a0"));
+    free(message);
+    smq_delete(reader);
+
+    assert(smq_snapshot(writer, path));
+    smq_delete(writer);
+
+    // Restored outgoing messages are sent in their original order (the
+    // retried one first), the expired one is dropped, and the scheduled one
+    // waits for its time again
+    config.host     = HOST;
+    config.snapshot = path;
+    SMQ *restored = smq_create_ex(&config);
+    assert(restored);
+    assert(access(path, F_OK) < 0);
+    assert(access(incomplete, F_OK) < 0);
+    assert(restored->scheduled->size == 1);
+    for (const char *expected[] = { "o0", "o1", "o2", "o3", NULL }, **e = expected; *e; e++) {
+        char *message = smq_retrieve_until(check, deadline_after(1000));
+        assert(message && streq(message, *e));
+        free(message);
+    }
+    assert(smq_retrieve_until(check, deadline_after(200)) == NULL);
+
+    // A truncated snapshot is kept rather than removed
+    assert(smq_snapshot(restored, path));
+    smq_delete(restored);
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert(truncate(path, st.st_size - 1) == 0);
+    restored = smq_create_ex(&config);
+    assert(restored);
+    assert(restored->scheduled->size == 0);
+    assert(access(path, F_OK) < 0);
+    assert(access(incomplete, F_OK) == 0);
+    smq_delete(restored);
+
+    unlink(incomplete);
+    smq_delete(check);
+    return EXIT_SUCCESS;
+}
+
+int test_04_client_throttle() {
+    SMQ *smq = client_create((SMQConfig){ .name = "unit.throttle" });
+    assert(smq);
+    smq_subscribe(smq, "throttle.#");
+
+    // A delayed topic does not hold up the messages of other topics
+    assert(smq_throttle(smq, "throttle.slow", 2, 1, false));
+    Deadline start = deadline_after(0);
+    for (int i = 0; i < 3; i++) {
+        smq_publish(smq, "throttle.slow", "slow");
+    }
+    smq_publish(smq, "throttle.fast", "fast");
+
+    const char *expected[] = { "slow", "fast", "slow", "slow" };
+    for (int i = 0; i < 4; i++) {
+        char *message = smq_retrieve_until(smq, deadline_after(2000));
+        assert(message && streq(message, expected[i]));
+        free(message);
+        if (i == 1) assert(deadline_after(0) - start < 400000000ULL);
+    }
+    assert(deadline_after(0) - start >= 900000000ULL);
+
+    // A message rejected by one limit gives back the tokens it took from others
+    assert(smq_throttle(smq, "throttle.rejected", 0.001, 1, true));
+    assert(smq_throttle(smq, NULL, 0.001, 2, true));
+    smq_publish(smq, "throttle.rejected", "r0");
+    smq_publish(smq, "throttle.rejected", "r1");
+    smq_publish(smq, "throttle.other", "other");
+
+    for (const char *e[] = { "r0", "other", NULL }, **m = e; *m; m++) {
+        char *message = smq_retrieve_until(smq, deadline_after(1000));
+        assert(message && streq(message, *m));
+        free(message);
+    }
+    assert(smq->throttles->rejected == 0);
+    assert(smq->throttles->next->rejected == 1);
+
+    smq_delete(smq);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test client_config\n");
+        fprintf(stderr, "    1. Test client_environment\n");
+        fprintf(stderr, "    2. Test client_partition\n");
+        fprintf(stderr, "    3. Test client_snapshot\n");
+        fprintf(stderr, "    4. Test client_throttle\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_client_config(); break;
+        case 1:  status = test_01_client_environment(); break;
+        case 2:  status = test_02_client_partition(); break;
+        case 3:  status = test_03_client_snapshot(); break;
+        case 4:  status = test_04_client_throttle(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,186 @@
+/* unit_endpoint.c: Test SMQ Broker Endpoints (Unit) */
+
+#include "smq/endpoint.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define KEYS    (1000)
+
+/* Functions */
+
+int test_00_endpoints_create() {
+    assert(endpoints_create(NULL, "9000", 1, 100) == NULL);
+    assert(endpoints_create(",,", "9000", 1, 100) == NULL);
+
+    // Bare hosts take the default port, the rest are kept as given
+    Endpoints *e = endpoints_create("a,,b:99,smq://local", "9000", 0, 100);
+    assert(e);
+    assert(e->count == 3);
+    assert(e->threshold == 1);
+    assert(streq(e->endpoints[0].url, "http://a:9000"));
+    assert(streq(e->endpoints[1].url, "http://b:99"));
+    assert(streq(e->endpoints[2].url, "smq://local"));
+
+    // Rotating spreads Requests, otherwise the first one is preferred
+    bool probe;
+    assert(endpoints_acquire(e, true, &probe) == 0);
+    assert(endpoints_acquire(e, true, &probe) == 1);
+    assert(endpoints_acquire(e, true, &probe) == 2);
+    assert(endpoints_acquire(e, false, &probe) == 0);
+    assert(!probe);
+
+    endpoints_delete(e);
+    return EXIT_SUCCESS;
+}
+
+int test_01_endpoints_breaker() {
+    Endpoints *e = endpoints_create("a,b", "9000", 2, 100);
+    assert(e);
+    bool probe;
+
+    // Closed: one failure short of threshold keeps broker in use
+    endpoints_report(e, 0, false);
+    assert(endpoints_check(e, 0, &probe) && !probe);
+    endpoints_report(e, 0, true);
+    endpoints_report(e, 0, false);
+    assert(endpoints_check(e, 0, &probe) && !probe);
+
+    // Open: threshold consecutive failures take it out until cooldown
+    endpoints_report(e, 0, false);
+    assert(!endpoints_check(e, 0, &probe) && !probe);
+    assert(endpoints_acquire(e, false, &probe) == 1);
+    endpoints_report(e, 1, false);
+    endpoints_report(e, 1, false);
+    assert(endpoints_acquire(e, false, &probe) == -1);
+
+    // Half-open: after cooldown exactly one caller gets to probe it
+    usleep(120000);
+    assert(endpoints_check(e, 0, &probe) && probe);
+    assert(!endpoints_check(e, 0, &probe) && !probe);
+
+    // A failed probe opens it again for twice as long
+    endpoints_report(e, 0, false);
+    usleep(100000);
+    assert(!endpoints_check(e, 0, &probe));
+    usleep(120000);
+    assert(endpoints_acquire(e, false, &probe) == 0 && probe);
+
+    // A healthy probe closes it, with the cooldown back to its start
+    endpoints_report(e, 0, true);
+    assert(endpoints_check(e, 0, &probe) && !probe);
+    assert(e->endpoints[0].failures == 0);
+    assert(e->endpoints[0].cooldown == e->cooldown);
+
+    endpoints_delete(e);
+    return EXIT_SUCCESS;
+}
+
+int test_02_endpoints_owner() {
+    Endpoints *e = endpoints_create("a,b,c,d", "9000", 1, 60000);
+    Endpoints *f = endpoints_create("a,b,c,d", "9000", 1, 60000);
+    assert(e && f);
+    assert(endpoints_partition(e, 64) && endpoints_partition(f, 64));
+
+    // Each key has the same owner every time (and in every client), and
+    // every broker gets a fair share of keys
+    char key[BUFSIZ];
+    bool probe;
+    size_t owners[KEYS], shares[4] = {0};
+    for (size_t k = 0; k < KEYS; k++) {
+        snprintf(key, sizeof(key), "topic.%lu", k);
+        ssize_t owner = endpoints_owner(e, key, &probe);
+        assert(owner >= 0 && !probe);
+        assert(endpoints_owner(e, key, &probe) == owner);
+        assert(endpoints_owner(f, key, &probe) == owner);
+        assert(endpoints_home(e, key) == (size_t)owner);
+        owners[k] = owner;
+        shares[owner]++;
+    }
+    for (size_t i = 0; i < 4; i++) {
+        assert(shares[i] > KEYS / 8);
+    }
+
+    // Keys of a failed broker move, but nobody else's do (and the home,
+    // which picks the pusher, stays put)
+    endpoints_report(e, 1, false);
+    for (size_t k = 0; k < KEYS; k++) {
+        snprintf(key, sizeof(key), "topic.%lu", k);
+        ssize_t owner = endpoints_owner(e, key, &probe);
+        assert(owners[k] == 1 ? owner != 1 && owner >= 0 : owner == (ssize_t)owners[k]);
+        assert(endpoints_home(e, key) == owners[k]);
+    }
+
+    endpoints_delete(e);
+    endpoints_delete(f);
+    return EXIT_SUCCESS;
+}
+
+int test_03_endpoints_resize() {
+    Endpoints *e = endpoints_create("a,b,c,d", "9000", 1, 60000);
+    Endpoints *f = endpoints_create("a,b,c,d,e", "9000", 1, 60000);
+    Endpoints *g = endpoints_create("a,c,d", "9000", 1, 60000);
+    assert(e && f && g);
+    assert(endpoints_partition(e, 64) && endpoints_partition(f, 64) && endpoints_partition(g, 64));
+
+    // Adding a broker only moves keys to it (about a fifth of them), and
+    // removing one only moves its own keys, wherever it was in the list
+    char key[BUFSIZ];
+    size_t added = 0, removed = 0;
+    for (size_t k = 0; k < KEYS; k++) {
+        snprintf(key, sizeof(key), "topic.%lu", k);
+        const char *before = e->endpoints[endpoints_home(e, key)].url;
+        const char *grown  = f->endpoints[endpoints_home(f, key)].url;
+        const char *shrunk = g->endpoints[endpoints_home(g, key)].url;
+
+        if (!streq(before, grown)) {
+            assert(streq(grown, "http://e:9000"));
+            added++;
+        }
+        if (!streq(before, shrunk)) {
+            assert(streq(before, "http://b:9000"));
+            removed++;
+        } else {
+            assert(!streq(before, "http://b:9000"));
+        }
+    }
+    assert(added > KEYS / 10 && added < KEYS / 10 * 3);
+    assert(removed > KEYS / 8 && removed < KEYS / 8 * 3);
+
+    endpoints_delete(e);
+    endpoints_delete(f);
+    endpoints_delete(g);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test endpoints_create\n");
+        fprintf(stderr, "    1. Test endpoints_breaker\n");
+        fprintf(stderr, "    2. Test endpoints_owner\n");
+        fprintf(stderr, "    3. Test endpoints_resize\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_endpoints_create(); break;
+        case 1:  status = test_01_endpoints_breaker(); break;
+        case 2:  status = test_02_endpoints_owner(); break;
+        case 3:  status = test_03_endpoints_resize(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
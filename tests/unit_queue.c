@@ -8,12 +8,14 @@
 
 /* Constants */
 
+#define QUEUE_BUCKETS   (64)
+
 Request REQUESTS[] = {
-    { "m0", "u0", "b0" },
-    { "m1", "u1", "b1" },
-    { "m2", "u2", "b2" },
-    { "m3", "u3", "b3" },
-    { "m4", "u4", "b4" },
+    { "m0", "u0", "b0", 2 },
+    { "m1", "u1", "b1", 2 },
+    { "m2", "u2", "b2", 2 },
+    { "m3", "u3", "b3", 2 },
+    { "m4", "u4", "b4", 2 },
     { NULL, NULL },
 };
 
@@ -103,6 +105,179 @@ int test_04_queue_shutdown() {
     return EXIT_SUCCESS;
 }
 
+int test_05_queue_limit() {
+    Queue *q = queue_create();
+    assert(q);
+
+    queue_limit(q, 6, 4, 2);
+    assert(queue_writable(q, 10));
+
+    queue_push(q, &REQUESTS[0]);
+    assert(q->bytes == 2);
+    assert(!q->throttled);
+
+    queue_push(q, &REQUESTS[1]);
+    assert(q->bytes == 4);
+    assert(q->throttled);
+    assert(!queue_writable(q, 10));
+
+    assert(queue_pop(q, 1000) == &REQUESTS[0]);
+    assert(q->bytes == 2);
+    assert(!q->throttled);
+    assert(queue_writable(q, 10));
+
+    assert(queue_pop(q, 1000) == &REQUESTS[1]);
+    assert(q->bytes == 0);
+    assert(queue_pop(q, 10) == NULL);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_06_queue_reserve() {
+    Queue *q = queue_create();
+    assert(q);
+
+    queue_capacity(q, 2);
+    assert(queue_reserve(q, 10));
+    assert(queue_reserve(q, 10));
+    assert(q->reserved == 2);
+    assert(!queue_reserve(q, 10));
+
+    assert(queue_commit(q, &REQUESTS[0]));
+    assert(q->size == 1);
+    assert(q->reserved == 1);
+    assert(!queue_reserve(q, 10));
+
+    queue_release(q);
+    assert(q->reserved == 0);
+    assert(queue_reserve(q, 10));
+
+    queue_shutdown(q);
+    assert(!queue_commit(q, &REQUESTS[1]));
+    assert(q->size == 1);
+    assert(q->reserved == 0);
+
+    assert(queue_pop(q, 10) == &REQUESTS[0]);
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+Request * keyed_request(const char *key, const char *body) {
+    Request *r = request_create("PUT", "topic", body);
+    assert(r);
+    r->key = strdup(key);
+    return r;
+}
+
+int test_07_queue_conflate() {
+    Queue *q = queue_create();
+    assert(q);
+
+    Request *first = keyed_request("k0", "a");
+    queue_push(q, first);
+    queue_push(q, keyed_request("k1", "bb"));
+    queue_push(q, keyed_request("k0", "ccc"));
+    assert(q->size == 2);
+    assert(q->keyed == 2);
+    assert(q->bytes == 5);
+    assert(q->head == first);
+    assert(streq(first->body, "ccc"));
+
+    char key[BUFSIZ];
+    for (size_t k = 0; k < 2*QUEUE_BUCKETS; k++) {
+        snprintf(key, BUFSIZ, "n%lu", k);
+        queue_push(q, keyed_request(key, "d"));
+        queue_push(q, keyed_request(key, "e"));
+    }
+    assert(q->size == 2 + 2*QUEUE_BUCKETS);
+    assert(q->buckets > QUEUE_BUCKETS);
+
+    Request *r = queue_pop(q, 10);
+    assert(r == first);
+    assert(q->keyed == 1 + 2*QUEUE_BUCKETS);
+    request_delete(r);
+
+    queue_push(q, keyed_request("k0", "f"));
+    assert(q->size == 2 + 2*QUEUE_BUCKETS);
+    assert(streq(q->tail->body, "f"));
+
+    while ((r = queue_pop(q, 10))) {
+        assert(!r->key || streq(r->key, "k0") || streq(r->key, "k1") || streq(r->body, "e"));
+        request_delete(r);
+    }
+    assert(q->keyed == 0);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_08_queue_deadline() {
+    Queue *q = queue_create();
+    assert(q);
+
+    // Waits end at the deadline (measured on the monotonic clock)
+    Deadline deadline = deadline_after(50);
+    assert(queue_pop_until(q, deadline) == NULL);
+    assert(deadline_expired(deadline));
+    assert(deadline_remaining(deadline) == 0);
+    assert(deadline_remaining(deadline_after(1000)) > 900);
+    assert(!deadline_expired(DEADLINE_NEVER));
+
+    // A push that times out leaves the Request with the caller
+    queue_capacity(q, 1);
+    assert(queue_push_until(q, &REQUESTS[0], deadline_after(10)));
+    assert(!queue_push_until(q, &REQUESTS[1], deadline_after(10)));
+    assert(q->size == 1);
+
+    assert(queue_pop_until(q, deadline_after(0)) == &REQUESTS[0]);
+    assert(queue_push_until(q, &REQUESTS[1], deadline_after(0)));
+    assert(queue_pop_until(q, DEADLINE_NEVER) == &REQUESTS[1]);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+static void collect_expired(Request *r, void *arg) {
+    r->next = *(Request **)arg;
+    *(Request **)arg = r;
+}
+
+int test_09_queue_expire() {
+    Queue *q = queue_create();
+    assert(q);
+
+    Request *expired = NULL;
+    queue_expire(q, collect_expired, &expired);
+
+    // Expired Requests at the front are dropped (and handed to expire)
+    Request late[3] = {
+        { .body = "0", .deadline = deadline_after(0) },
+        { .body = "1", .deadline = deadline_after(60000) },
+        { .body = "2", .deadline = deadline_after(0) },
+    };
+    for (size_t i = 0; i < 3; i++) {
+        assert(queue_push(q, &late[i]));
+    }
+    assert(queue_push(q, &REQUESTS[0]));
+    assert(q->size == 4);
+
+    assert(queue_pop(q, 0) == &late[1]);
+    assert(expired == &late[0] && q->expired == 1);
+    assert(queue_pop(q, 0) == &REQUESTS[0]);
+    assert(expired == &late[2] && expired->next == &late[0]);
+    assert(q->expired == 2 && q->size == 0 && q->bytes == 0);
+
+    // A queue holding only expired Requests behaves as empty
+    Request stale = { .body = "stale", .deadline = deadline_after(0) };
+    assert(queue_push(q, &stale));
+    assert(queue_pop(q, 10) == NULL);
+    assert(expired == &stale && q->expired == 3);
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -114,6 +289,11 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    2. Test queue_pop\n");
         fprintf(stderr, "    3. Test queue_delete\n");
         fprintf(stderr, "    4. Test queue_shutdown\n");
+        fprintf(stderr, "    5. Test queue_limit\n");
+        fprintf(stderr, "    6. Test queue_reserve\n");
+        fprintf(stderr, "    7. Test queue_conflate\n");
+        fprintf(stderr, "    8. Test queue_deadline\n");
+        fprintf(stderr, "    9. Test queue_expire\n");
         return EXIT_FAILURE;
     }
 
@@ -126,6 +306,11 @@ int main(int argc, char *argv[]) {
         case 2:  status = test_02_queue_pop(); break;
         case 3:  status = test_03_queue_delete(); break;
         case 4:  status = test_04_queue_shutdown(); break;
+        case 5:  status = test_05_queue_limit(); break;
+        case 6:  status = test_06_queue_reserve(); break;
+        case 7:  status = test_07_queue_conflate(); break;
+        case 8:  status = test_08_queue_deadline(); break;
+        case 9:  status = test_09_queue_expire(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -5,11 +5,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 /* Type Definitions */
 
 typedef struct {
@@ -43,6 +47,7 @@ int test_00_request_create() {
     assert(streq(r0->method, "GET"));
     assert(streq(r0->url   , URL));
     assert(streq(r0->body  , BODY));
+    assert(r0->length == strlen(BODY));
     free(r0->method);
     free(r0->url);
     free(r0->body);
@@ -53,6 +58,7 @@ int test_00_request_create() {
     assert(streq(r1->method, "GET"));
     assert(streq(r1->url, URL));
     assert(r1->body == NULL);
+    assert(r1->length == 0);
     free(r1->method);
     free(r1->url);
     free(r1);
@@ -178,6 +184,65 @@ int test_04_request_perform_delete() {
     return EXIT_SUCCESS;
 }
 
+/**
+ * Accept one connection on listening socket and keep what client sent first.
+ **/
+void * capture_request(void *arg) {
+    int  *server = arg;
+    char *buffer = calloc(1, BUFSIZ);
+    int   client = accept(*server, NULL, NULL);
+    if (client >= 0) {
+        for (size_t n = 0; n < BUFSIZ - 1 && !strstr(buffer, "\r\n\r\n"); ) {
+            ssize_t nread = read(client, buffer + n, BUFSIZ - 1 - n);
+            if (nread <= 0) break;
+            n += nread;
+        }
+        close(client);
+    }
+    return buffer;
+}
+
+/**
+ * Perform GET of path on local port with url scheme, and return what the
+ * broker would have received.
+ **/
+char * capture_perform(const char *scheme) {
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    assert(server >= 0);
+    assert(bind(server, (struct sockaddr *)&address, sizeof(address)) == 0);
+    assert(listen(server, 1) == 0);
+    assert(getsockname(server, (struct sockaddr *)&address, &length) == 0);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, capture_request, &server) == 0);
+
+    char url[BUFSIZ];
+    snprintf(url, sizeof(url), "%s127.0.0.1:%d/queue/unit", scheme, ntohs(address.sin_port));
+    Request request = {"GET", url, NULL};
+    assert(request_perform(&request, 1000) == NULL);
+
+    char *received;
+    pthread_join(thread, (void **)&received);
+    close(server);
+    return received;
+}
+
+int test_05_request_perform_h2c() {
+    // h2c:// is sent to the same host and port as http://, but opens with
+    // the HTTP/2 connection preface instead of an HTTP/1.1 request line
+    char *received = capture_perform("h2c://");
+    assert(strncmp(received, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) == 0);
+    free(received);
+
+    received = capture_perform("http://");
+    assert(strncmp(received, "GET /queue/unit HTTP/1.1\r\n", 26) == 0);
+    free(received);
+
+    return EXIT_SUCCESS;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -189,6 +254,7 @@ int main(int argc, char *argv[]) {
 	fprintf(stderr, "    2. Test request_perform_(get)\n");
 	fprintf(stderr, "    3. Test request_perform_(put)\n");
 	fprintf(stderr, "    4. Test request_perform_(delete)\n");
+	fprintf(stderr, "    5. Test request_perform_(h2c)\n");
 	return EXIT_FAILURE;
     }
 
@@ -201,6 +267,7 @@ int main(int argc, char *argv[]) {
 	case 2:  status = test_02_request_perform_get(); break;
 	case 3:  status = test_03_request_perform_put(); break;
 	case 4:  status = test_04_request_perform_delete(); break;
+	case 5:  status = test_05_request_perform_h2c(); break;
 	default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -0,0 +1,130 @@
+/* unit_wheel.c: Test SMQ Hierarchical Timer Wheel of Requests (Unit) */
+
+#include "smq/thread.h"
+#include "smq/wheel.h"
+#include "smq/utils.h"
+
+#include <assert.h>
+
+/* Constants */
+
+Request REQUESTS[] = {
+    { "m0", "u0", "b0" },
+    { "m1", "u1", "b1" },
+    { "m2", "u2", "b2" },
+    { "m3", "u3", "b3" },
+    { "m4", "u4", "b4" },
+    { NULL, NULL },
+};
+
+/* Functions */
+
+int test_00_wheel_create() {
+    Wheel *w = wheel_create();
+    assert(w);
+    assert(w->size == 0);
+    assert(w->tick == 0);
+    assert(w->running);
+
+    wheel_delete(w);
+    return EXIT_SUCCESS;
+}
+
+int test_01_wheel_add() {
+    Wheel *w = wheel_create();
+    assert(w);
+
+    // Requests land on the level that covers their distance
+    assert(wheel_add(w, &REQUESTS[0], w->start + 10 * WHEEL_TICK));
+    assert(wheel_add(w, &REQUESTS[1], w->start + 1000 * WHEEL_TICK));
+    assert(wheel_add(w, &REQUESTS[2], w->start + 100000 * WHEEL_TICK));
+    assert(wheel_add(w, &REQUESTS[3], w->start + 100000000ULL * WHEEL_TICK));
+    assert(w->size == 4);
+
+    assert(w->slots[0][10].head == &REQUESTS[0]);
+    assert(w->slots[1][1000 >> 8].head == &REQUESTS[1]);
+    assert(w->slots[2][100000 >> 16].head == &REQUESTS[2]);
+    assert(w->slots[3][(100000000 >> 24) & 255].head == &REQUESTS[3]);
+
+    // A full wheel refuses Requests
+    wheel_capacity(w, 4);
+    assert(!wheel_add(w, &REQUESTS[4], w->start));
+
+    free(w);
+    return EXIT_SUCCESS;
+}
+
+int test_02_wheel_take() {
+    Wheel *w = wheel_create();
+    assert(w);
+
+    // Requests come due in order of due time (and not before it)
+    Deadline start = deadline_after(0);
+    assert(wheel_add(w, &REQUESTS[2], deadline_after(300)));
+    assert(wheel_add(w, &REQUESTS[0], deadline_after(20)));
+    assert(wheel_add(w, &REQUESTS[1], deadline_after(20)));
+
+    Request *due = wheel_take(w, DEADLINE_NEVER);
+    assert(due == &REQUESTS[0]);
+    assert(due->next == &REQUESTS[1]);
+    assert(due->next->next == NULL);
+    assert(deadline_after(0) - start >= 20 * WHEEL_TICK);
+
+    // Due time 300ms away is cascaded down from level 1 before it expires
+    assert(wheel_take(w, deadline_after(10)) == NULL);
+    due = wheel_take(w, DEADLINE_NEVER);
+    assert(due == &REQUESTS[2] && due->next == NULL);
+    assert(deadline_after(0) - start >= 300 * WHEEL_TICK);
+    assert(deadline_after(0) - start <  500 * WHEEL_TICK);
+    assert(w->size == 0);
+
+    // Requests due in the past come due with the next tick
+    assert(wheel_add(w, &REQUESTS[3], start));
+    assert(wheel_take(w, deadline_after(2)) == &REQUESTS[3]);
+
+    free(w);
+    return EXIT_SUCCESS;
+}
+
+int test_03_wheel_shutdown() {
+    Wheel *w = wheel_create();
+    assert(w);
+
+    assert(wheel_add(w, &REQUESTS[0], deadline_after(60000)));
+    wheel_shutdown(w);
+    assert(wheel_take(w, DEADLINE_NEVER) == NULL);
+    assert(!wheel_add(w, &REQUESTS[1], deadline_after(0)));
+    assert(w->size == 1);
+
+    free(w);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test wheel_create\n");
+        fprintf(stderr, "    1. Test wheel_add\n");
+        fprintf(stderr, "    2. Test wheel_take\n");
+        fprintf(stderr, "    3. Test wheel_shutdown\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_wheel_create(); break;
+        case 1:  status = test_01_wheel_add(); break;
+        case 2:  status = test_02_wheel_take(); break;
+        case 3:  status = test_03_wheel_shutdown(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */